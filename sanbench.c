@@ -0,0 +1,477 @@
+/*
+ * Headless SAN decoding benchmark.
+ *
+ * Decodes each file given from memory without any output and prints the
+ * decoding speed, the per-frame latency and where the time went, one stage
+ * per line, so that results of different builds can be diffed.
+ * Needs sandec.c built with SANDEC_STATS defined.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "sandec.h"
+
+/* latency samples of a stage, one per decoded frame */
+struct lat {
+	uint64_t *v;
+	uint32_t n;
+	uint32_t max;
+};
+
+struct bench {
+	struct lat lat[SANDEC_ST_NUM];
+	struct sanstat tot[SANDEC_ST_NUM];
+	struct sancounts cnt;
+	uint64_t ns;		/* wall clock time decoding */
+	uint64_t frames;	/* images output, FRMEs when audio only */
+	uint64_t abytes;	/* audio output */
+};
+
+struct benchpriv {
+	const uint8_t *data;
+	uint32_t size;
+	uint64_t frames;
+	uint64_t abytes;
+};
+
+static const char * const stname[SANDEC_ST_NUM] = {
+	"frame", "read", "codec1", "codec37", "codec47", "codec48",
+	"iact", "npal", "xpal", "ftch", "ipol", "output",
+};
+
+/* Chrome trace output */
+static FILE *trf;
+static int trcnt;
+static pthread_mutex_t trmtx = PTHREAD_MUTEX_INITIALIZER;
+
+static const char * const fmtname[] = {
+	"index8", "argb8888", "xrgb8888", "rgb565", "i420", "nv12",
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int lat_add(struct lat *l, uint64_t ns)
+{
+	uint64_t *v;
+
+	if (l->n >= l->max) {
+		v = realloc(l->v, (l->max + 4096) * sizeof(uint64_t));
+		if (!v)
+			return 1;
+		l->v = v;
+		l->max += 4096;
+	}
+	l->v[l->n++] = ns;
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* p-th percentile; sorts the samples */
+static uint64_t lat_pct(struct lat *l, int p)
+{
+	if (!l->n)
+		return 0;
+	qsort(l->v, l->n, sizeof(uint64_t), cmp_u64);
+	return l->v[(uint64_t)(l->n - 1) * p / 100];
+}
+
+static void queue_audio(void *ctx, unsigned char *adata, uint32_t size)
+{
+	struct benchpriv *p = (struct benchpriv *)ctx;
+	p->abytes += size;
+}
+
+static void queue_video(void *ctx, unsigned char *vdata, uint32_t size,
+			uint16_t w, uint16_t h, uint32_t *imgpal, uint16_t subid,
+			uint32_t frame_duration_us)
+{
+	struct benchpriv *p = (struct benchpriv *)ctx;
+	p->frames++;
+}
+
+/* one complete event per stage, each stage on its own track */
+static void trace(void *ctx, int stage, uint64_t start, uint64_t ns)
+{
+	pthread_mutex_lock(&trmtx);
+	fprintf(trf, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		"\"ts\":%.3f,\"dur\":%.3f}\n", trcnt++ ? "," : "",
+		stname[stage], stage, start / 1e3, ns / 1e3);
+	pthread_mutex_unlock(&trmtx);
+}
+
+/* non-empty bins of a histogram, 8 per line; opcodes in hex */
+static void print_hist(FILE *f, const char *name, const uint64_t *h, int n,
+		       int hex)
+{
+	int i, k = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!h[i])
+			continue;
+		if (k++ % 8 == 0)
+			fprintf(f, "%s  %-8s", k > 1 ? "\n" : "", k > 1 ? "" : name);
+		fprintf(f, hex ? " %02x:%llu" : " %d:%llu", i, (unsigned long long)h[i]);
+	}
+	if (k)
+		fprintf(f, "\n");
+}
+
+static void print_counts(FILE *f, struct sancounts *c)
+{
+	static const char * const bsz[3] = { "8", "4", "2" };
+	char name[16];
+	int i;
+
+	fprintf(f, "  bytes %llu frme %llu falloc %llu fcgrow %llu fchit %llu\n",
+		(unsigned long long)c->bytes, (unsigned long long)c->frme,
+		(unsigned long long)c->falloc, (unsigned long long)c->fcgrow,
+		(unsigned long long)c->fchit);
+	fprintf(f, "  chunks npal %llu fobj %llu iact %llu tres %llu stor %llu"
+		" ftch %llu xpal %llu psad %llu other %llu\n",
+		(unsigned long long)c->npal, (unsigned long long)c->fobj,
+		(unsigned long long)c->iact, (unsigned long long)c->tres,
+		(unsigned long long)c->stor, (unsigned long long)c->ftch,
+		(unsigned long long)c->xpal, (unsigned long long)c->psad,
+		(unsigned long long)c->other);
+	print_hist(f, "codecs", c->codec, 256, 0);
+	print_hist(f, "c37op", c->c37op, 256, 1);
+	for (i = 0; i < 3; i++) {
+		sprintf(name, "c47op%s", bsz[i]);
+		print_hist(f, name, c->c47op[i], 256, 1);
+	}
+	for (i = 0; i < 3; i++) {
+		sprintf(name, "c47mv%s", bsz[i]);
+		print_hist(f, name, c->c47mv[i], SANDEC_MVBINS, 0);
+	}
+	print_hist(f, "c48op", c->c48op, 256, 1);
+	for (i = 0; i < 3; i++) {
+		sprintf(name, "c48mv%s", bsz[i]);
+		print_hist(f, name, c->c48mv[i], SANDEC_MVBINS, 0);
+	}
+}
+
+/* write the counters of a file to dir/<file name>.prof */
+static int write_profile(const char *dir, const char *fn, struct bench *b)
+{
+	const char *base = strrchr(fn, '/');
+	char *path;
+	FILE *f;
+
+	base = base ? base + 1 : fn;
+	path = malloc(strlen(dir) + strlen(base) + 7);
+	if (!path)
+		return 1;
+	sprintf(path, "%s/%s.prof", dir, base);
+	f = fopen(path, "w");
+	free(path);
+	if (!f)
+		return 1;
+	fprintf(f, "%s: %llu frames\n", fn, (unsigned long long)b->frames);
+	print_counts(f, &b->cnt);
+	return fclose(f) != 0;
+}
+
+/* add up the counters of c into t */
+static void add_counts(struct sancounts *t, const struct sancounts *c)
+{
+	uint64_t *d = (uint64_t *)t;
+	const uint64_t *s = (const uint64_t *)c;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(struct sancounts) / sizeof(uint64_t); i++)
+		d[i] += s[i];
+}
+
+static void print_bench(const char *name, struct bench *b, int verbose)
+{
+	uint64_t nf = b->frames ? b->frames : 1;
+	int i;
+
+	printf("%s: %llu frames, %.3f s, %.1f fps, %llu ns/frame, p50 %llu ns, p99 %llu ns\n",
+	       name, (unsigned long long)b->frames, b->ns / 1e9,
+	       b->ns ? b->frames * 1e9 / b->ns : 0.0,
+	       (unsigned long long)(b->ns / nf),
+	       (unsigned long long)lat_pct(&b->lat[SANDEC_ST_FRAME], 50),
+	       (unsigned long long)lat_pct(&b->lat[SANDEC_ST_FRAME], 99));
+	printf("  audio %.1f s, %.1f x realtime\n", b->abytes / (22050.0 * 4),
+	       b->ns ? b->abytes / (22050.0 * 4) * 1e9 / b->ns : 0.0);
+	printf("  %-8s %10s %10s %10s %10s %10s\n", "stage", "calls",
+	       "ns/call", "p50", "p99", "total ms");
+	for (i = 0; i < SANDEC_ST_NUM; i++) {
+		if (!b->tot[i].count)
+			continue;
+		printf("  %-8s %10llu %10llu %10llu %10llu %10.1f\n", stname[i],
+		       (unsigned long long)b->tot[i].count,
+		       (unsigned long long)(b->tot[i].ns / b->tot[i].count),
+		       (unsigned long long)lat_pct(&b->lat[i], 50),
+		       (unsigned long long)lat_pct(&b->lat[i], 99),
+		       b->tot[i].ns / 1e6);
+	}
+	if (verbose)
+		print_counts(stdout, &b->cnt);
+}
+
+static void bench_free(struct bench *b)
+{
+	int i;
+
+	for (i = 0; i < SANDEC_ST_NUM; i++)
+		free(b->lat[i].v);
+	memset(b, 0, sizeof(struct bench));
+}
+
+/* merge the results of a file into the overall ones */
+static int bench_merge(struct bench *all, struct bench *b)
+{
+	uint32_t j;
+	int i;
+
+	for (i = 0; i < SANDEC_ST_NUM; i++) {
+		all->tot[i].ns += b->tot[i].ns;
+		all->tot[i].count += b->tot[i].count;
+		for (j = 0; j < b->lat[i].n; j++)
+			if (lat_add(&all->lat[i], b->lat[i].v[j]))
+				return 1;
+	}
+	add_counts(&all->cnt, &b->cnt);
+	all->ns += b->ns;
+	all->frames += b->frames;
+	all->abytes += b->abytes;
+	return 0;
+}
+
+static int load_file(const char *fn, struct benchpriv *p)
+{
+	FILE *f;
+	long sz;
+	uint8_t *buf;
+	int ret = 1;
+
+	f = fopen(fn, "rb");
+	if (!f)
+		return 1;
+	if (fseek(f, 0, SEEK_END) || (sz = ftell(f)) <= 0 || fseek(f, 0, SEEK_SET))
+		goto out;
+	buf = malloc(sz);
+	if (!buf)
+		goto out;
+	if (fread(buf, 1, sz, f) != (size_t)sz) {
+		free(buf);
+		goto out;
+	}
+	p->data = buf;
+	p->size = sz;
+	ret = 0;
+out:
+	fclose(f);
+	return ret;
+}
+
+/* decode a file rep times, and collect the stage timing per frame.  With
+ * count, the counters come from one more decoding pass that counts the
+ * codec opcodes, too, and is not timed.
+ */
+static int bench_file(struct benchpriv *p, struct bench *b, int flags,
+		      int fmt, int threads, int decim, int rep, int count)
+{
+	struct sanstats st;
+	struct sanio sio;
+	void *sanctx;
+	uint64_t t0;
+	int i, ret;
+
+	memset(&sio, 0, sizeof(struct sanio));
+	sio.userctx = p;
+	sio.queue_audio = queue_audio;
+	sio.queue_video = queue_video;
+	sio.flags = flags;
+
+	ret = sandec_init(&sanctx);
+	if (ret)
+		return ret;
+	ret = sandec_output(sanctx, fmt, NULL, 0);
+	if (ret == 0 && threads)
+		ret = sandec_threads(sanctx, threads);
+	if (ret == 0)
+		ret = sandec_decimate(sanctx, decim);
+	if (ret == 0 && trf)
+		ret = sandec_trace(sanctx, trace);
+	if (ret)
+		goto out;
+
+	while (rep--) {
+		ret = sandec_open_memory(sanctx, &sio, p->data, p->size);
+		if (ret)
+			goto out;
+		p->frames = 0;
+		p->abytes = 0;
+		do {
+			/* only the decoding call is timed, not the stats below */
+			t0 = now_ns();
+			ret = sandec_decode_next_frame(sanctx);
+			b->ns += now_ns() - t0;
+			if (ret == SANDEC_OK && (flags & SANDEC_FLAG_AUDIO_ONLY))
+				p->frames++;
+			if (sandec_get_stats(sanctx, &st) == 0) {
+				for (i = 0; i < SANDEC_ST_NUM; i++) {
+					if (st.frame[i].count &&
+					    lat_add(&b->lat[i], st.frame[i].ns)) {
+						ret = 5;
+						goto out;
+					}
+				}
+			}
+		} while (ret == SANDEC_OK);
+		b->frames += p->frames;
+		b->abytes += p->abytes;
+		if (ret != SANDEC_DONE)
+			goto out;
+		ret = sandec_get_stats(sanctx, &st);
+		if (ret)
+			goto out;
+		for (i = 0; i < SANDEC_ST_NUM; i++) {
+			b->tot[i].ns += st.total[i].ns;
+			b->tot[i].count += st.total[i].count;
+		}
+	}
+
+	if (count) {
+		sio.flags = flags | SANDEC_FLAG_COUNT_OPS;
+		sandec_trace(sanctx, NULL);
+		ret = sandec_open_memory(sanctx, &sio, p->data, p->size);
+		while (ret == SANDEC_OK)
+			ret = sandec_decode_next_frame(sanctx);
+		if (ret != SANDEC_DONE)
+			goto out;
+		ret = sandec_get_stats(sanctx, &st);
+		if (ret)
+			goto out;
+		add_counts(&b->cnt, &st.ctotal);
+	}
+	ret = 0;
+out:
+	sandec_exit(&sanctx);
+	return ret;
+}
+
+int main(int a, char **argv)
+{
+	int i, opt, ret, err, flags, fmt, threads, decim, rep, nfiles, verbose;
+	const char *profdir = NULL;
+	struct bench all, b;
+	struct benchpriv p;
+
+	flags = 0;
+	fmt = SANDEC_FMT_INDEX8;
+	threads = 0;
+	decim = 1;
+	rep = 1;
+	verbose = 0;
+	while ((opt = getopt(a, argv, "iad:t:f:r:vT:p:")) != -1) {
+		switch (opt) {
+		case 'i': flags |= SANDEC_FLAG_DO_FRAME_INTERPOLATION; break;
+		case 'a': flags |= SANDEC_FLAG_AUDIO_ONLY; break;
+		case 'v': verbose = 1; break;
+		case 'p': profdir = optarg; break;
+		case 'T':
+			trf = fopen(optarg, "w");
+			if (!trf) {
+				printf("cannot create %s\n", optarg);
+				return 2;
+			}
+			fprintf(trf, "[\n");
+			break;
+		case 'd':
+			/* fast-forward preview */
+			decim = strtol(optarg, NULL, 10);
+			flags |= SANDEC_FLAG_VIDEO_ONLY;
+			break;
+		case 't': threads = strtol(optarg, NULL, 10); break;
+		case 'r': rep = strtol(optarg, NULL, 10); break;
+		case 'f':
+			for (fmt = 0; fmt <= SANDEC_FMT_NV12; fmt++)
+				if (!strcmp(optarg, fmtname[fmt]))
+					break;
+			if (fmt <= SANDEC_FMT_NV12)
+				break;
+			/* fallthrough */
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= a || rep < 1 || decim < 1)
+		goto usage;
+
+	memset(&all, 0, sizeof(struct bench));
+	memset(&b, 0, sizeof(struct bench));
+	printf("# flags %s threads %d format %s decimate %d repeat %d\n",
+	       (flags & SANDEC_FLAG_AUDIO_ONLY) ? "audio" :
+	       (flags & SANDEC_FLAG_VIDEO_ONLY) ? "video" :
+	       (flags ? "ipol" : "none"), threads, fmtname[fmt], decim, rep);
+
+	err = 0;
+	nfiles = 0;
+	for (i = optind; i < a; i++) {
+		memset(&p, 0, sizeof(struct benchpriv));
+		if (load_file(argv[i], &p)) {
+			printf("%s: cannot read file\n", argv[i]);
+			err = 2;
+			continue;
+		}
+		ret = bench_file(&p, &b, flags, fmt, threads, decim, rep,
+				 verbose || profdir);
+		free((void *)p.data);
+		if (ret) {
+			printf("%s: error %d\n", argv[i], ret);
+			if (ret == SANDEC_ERR_NOSTATS)
+				printf("sandec was built without SANDEC_STATS\n");
+			err = 3;
+		} else {
+			print_bench(argv[i], &b, verbose);
+			if (profdir && write_profile(profdir, argv[i], &b)) {
+				printf("%s: cannot write profile\n", argv[i]);
+				err = 4;
+			}
+			if (bench_merge(&all, &b))
+				err = 5;
+			nfiles++;
+		}
+		bench_free(&b);
+	}
+
+	if (nfiles > 1)
+		print_bench("all", &all, verbose);
+	bench_free(&all);
+	if (trf) {
+		fprintf(trf, "]\n");
+		fclose(trf);
+	}
+	return err;
+
+usage:
+	printf("usage: %s [-i] [-a] [-d n] [-t threads] [-f format] [-r repeat] [-v] [-T trace.json] [-p dir] <file.san/.anm>...\n", argv[0]);
+	printf(" -i: interpolate frames, -t: worker threads, -r: decode each file repeat times\n");
+	printf(" -a: decode only the audio, -d: only the video, and output every nth frame\n");
+	printf(" -v: print the decoder's counters, from an extra untimed pass\n");
+	printf(" -T: write a Chrome trace of the stages\n");
+	printf(" -p: write the counters incl. the block opcode and motion vector\n");
+	printf("     histograms of each file to dir/<file name>.prof, from the\n");
+	printf("     untimed pass, too\n");
+	printf(" -f: output format, index8 argb8888 xrgb8888 rgb565 i420 nv12\n");
+	return 1;
+}
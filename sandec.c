@@ -17,10 +17,17 @@
 
 #include <memory.h>
 #include <stdlib.h>
+#ifndef SANDEC_NO_THREADS
+#include <pthread.h>
+#endif
+#ifdef SANDEC_STATS
+#include <time.h>
+#endif
 #include "sandec.h"
 
 #ifndef _max
 #define _max(a,b) ((a) > (b) ? (a) : (b))
+#define _min(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
 #define bswap_16(value) \
@@ -76,13 +83,54 @@ static inline uint32_t ua32(uint8_t *p)
 
 #endif
 
+/* write little-endian values to unaligned memory */
+static inline void wr16le(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static inline void wr32le(uint8_t *p, uint32_t v)
+{
+	wr16le(p + 0, v & 0xffff);
+	wr16le(p + 2, v >> 16);
+}
+
+/* 32bit FNV-1a hash */
+static uint32_t fnv1a(const uint8_t *p, uint32_t len, uint32_t h)
+{
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+	return h;
+}
+
 /* sizes of various internal static buffers */
 #define SZ_IACT		(4096)
 #define SZ_PAL		(256 * 4)
 #define SZ_DELTAPAL	(768 * 2)
 #define SZ_C47IPTBL	(256 * 256)
 #define SZ_AUDIOOUT	(4096)
-#define SZ_ALL (SZ_IACT + SZ_PAL + SZ_DELTAPAL + SZ_C47IPTBL + SZ_AUDIOOUT)
+#define SZ_AQ		(4096 * 4)
+#define SZ_RECTS	(256)
+#define SZ_DPAL		(SZ_PAL * 4)
+#define SZ_ALL (SZ_IACT + SZ_PAL + SZ_DELTAPAL + SZ_C47IPTBL + SZ_AUDIOOUT + SZ_PAL \
+		+ SZ_RECTS * sizeof(struct sanrect) + SZ_DPAL)
+
+
+/* audio mixer limits */
+#define SANDEC_MAXACHAN	16	/* concurrent PSAD/iMUSE tracks		*/
+#define SZ_MIXBLK	(SZ_AUDIOOUT / 4)	/* stereo frames per mixed block */
+#define SZ_ACHHDR	1024	/* SAUD/iMUS track header		*/
+#define SZ_ACHRING	8192	/* initial track ring, stereo frames	*/
+#define MIX_RATE	22050	/* mixer output rate			*/
+
+
+/* worker pool limits */
+#define SANDEC_MAXTHREADS	16
+#define SZ_JOBS		(SANDEC_MAXTHREADS * 2)
+#define SANDEC_MAXFRAMES	8
 
 
 /* chunk identifiers LE */
@@ -96,12 +144,54 @@ static inline uint32_t ua32(uint8_t *p)
 #define STOR	0x524f5453
 #define FTCH	0x48435446
 #define XPAL	0x4c415058
-
+#define PSAD	0x44415350
+
+/* audio track header identifiers LE */
+#define SAUD	0x44554153
+#define SDAT	0x54414453
+#define IMUS	0x53554d69
+#define IMAP	0x2050414d
+#define FRMT	0x544d5246
+#define DATA	0x41544144
+
+
+/* FRME index sidecar */
+#define SIDX_MAGIC	0x58444953	/* "SIDX" */
+#define SIDX_VERSION	1
+#define SIDX_HDRSZ	32
+#define SIDX_ENTSZ	14
+
+/* decoder state snapshot */
+#define SSNP_MAGIC	0x504e5353	/* "SSNP" */
+#define SSNP_VERSION	2
+#define SSNP_HDRSZ	52
+#define SSNP_PARTS	8
+#define SSNP_NOBUF	0xff		/* image pointer not set	*/
+
+/* FRME index entry flags */
+#define FIDX_KEY	(1 << 0)	/* frame decodes without predecessors */
+#define FIDX_NPAL	(1 << 1)	/* frame carries a NPAL chunk		*/
+#define FIDX_XPAL	(1 << 2)	/* frame carries a XPAL chunk		*/
+#define FIDX_STOR	(1 << 3)	/* frame carries a STOR chunk		*/
+#define FIDX_FTCH	(1 << 4)	/* frame carries a FTCH chunk		*/
+#define FIDX_ITBL	(1 << 5)	/* frame carries a c47/48 interp. table */
 
 /* codec47 glyhps */
 #define GLYPH_COORD_VECT_SIZE 16
 #define NGLYPHS 256
 
+/* FRME index entry. The entry following the last indexed frame only
+ * has ofs and the IACT state valid, it is where index scanning resumes.
+ */
+struct sanfidx {
+	uint32_t ofs;		/* 4 file offset of the FRME chunk header */
+	uint32_t size;		/* 4 FRME payload size			*/
+	uint16_t iactpos;	/* 2 IACT reassembly position at frame start */
+	uint8_t  iacthdr[2];	/* 2 IACT packet header at frame start	*/
+	uint8_t  codec;		/* 1 codec id of the first FOBJ		*/
+	uint8_t  flags;		/* 1 FIDX_* flags			*/
+};
+
 /* internal context: per-file */
 struct sanrt {
 	uint32_t frmebufsz;	/* 4 size of buffer below		*/
@@ -113,6 +203,21 @@ struct sanrt {
 	uint8_t *buf4;		/* 8 last full frame for interpolation  */
 	uint8_t *buf5;		/* 8 interpolated frame                 */
 	uint8_t *vbuf;		/* 8 final image buffer passed to caller*/
+	uint8_t *dmap;		/* 8 1 byte per 8x8 block, 0 if unchanged */
+	uint8_t *dmapref;	/* 8 buffer dmap is relative to, or NULL */
+	uint8_t *ipref;		/* 8 last image for interpolation	*/
+	uint8_t *stor;		/* 8 image saved by STOR		*/
+	uint8_t *b0src;		/* 8 buffer with buf0's image, or NULL	*/
+	uint8_t *cmap;		/* 8 1 byte per 4x4 cell, 0 if unchanged */
+	uint8_t *cmapref;	/* 8 buffer cmap is relative to		*/
+	uint8_t *lastout;	/* 8 buffer with the last queued image	*/
+	uint8_t *c37ref;	/* 8 c37 buffer with the image of buf0, or NULL */
+	struct sanrect *rects;	/* 8 changed areas for queue_video_rects */
+	uint32_t *dpal;		/* 8 4x 256x palette in other formats	*/
+	uint32_t dpalgen[4];	/* 16 palette generation of each dpal	*/
+	uint32_t lastpalgen;	/* 4 palette generation of lastout	*/
+	uint8_t *obuf;		/* 8 image in output format		*/
+	uint8_t *olast;		/* 8 output buffer with the last queued image */
 	uint8_t *abuf;		/* 8 audio output buffer		*/
 	uint16_t pitch;		/* 2 image pitch			*/
 	uint16_t bufw;		/* 2 alloc'ed buffer width/pitch	*/
@@ -128,7 +233,18 @@ struct sanrt {
 	uint8_t *c47ipoltbl;	/* 8 c47 interpolation table Compression 1 */
 	int16_t  *deltapal;	/* 8 768x 16bit for XPAL chunks		*/
 	uint32_t *palette;	/* 8 256x ABGR				*/
+	uint32_t *ahdrpal;	/* 8 256x ABGR palette from AHDR	*/
 	uint8_t  *buf;		/* 8 fb baseptr				*/
+	struct sanfidx *fidx;	/* 8 FRME index, FRMEcnt + 1 entries	*/
+	uint32_t bufsize;	/* 4 size of the fb allocation w/o frame pool */
+	uint8_t *fpool;		/* 8 frame pool: nfpool images		*/
+	uint16_t nfpool;	/* 2 number of images in frame pool	*/
+	uint32_t fpos;		/* 4 current file offset		*/
+	uint32_t fidxcnt;	/* 4 number of indexed FRMEs		*/
+	const uint8_t *mem;	/* 8 in-memory file data, or NULL	*/
+	uint32_t memsize;	/* 4 size of in-memory file data	*/
+	uint32_t animsize;	/* 4 size of the ANIM chunk		*/
+	uint32_t ahdrhash;	/* 4 FNV-1a hash of the AHDR chunk	*/
 	uint32_t fbsize;	/* 4 size of the framebuffers		*/
 	uint32_t framedur;	/* 4 standard frame duration		*/
 	uint32_t samplerate;	/* 4 audio samplerate in Hz		*/
@@ -138,19 +254,274 @@ struct sanrt {
 	uint8_t  have_itable:1;	/* 1 have c47/48 interpolation table    */
 	uint8_t  can_ipol:1;	/* 1 do an interpolation                */
 	uint8_t  have_ipframe:1;/* 1 we have an interpolated frame      */
+	uint8_t  cmap_all:1;	/* 1 everything changed, ignore cmap	*/
+	uint8_t  ipol_same:1;	/* 1 ipol frame changed the cmap cells only */
+	uint8_t  oready:1;	/* 1 image already in output format	*/
+	uint16_t dskip;		/* 2 frames left to drop by decimation	*/
+	uint8_t  obpp;		/* 1 output bytes per pixel, 0 for INDEX8/YUV */
+	uint32_t osize;		/* 4 size of an output image, 0 for INDEX8 */
+	uint8_t *aq;		/* 8 deferred audio output		*/
+	uint32_t aqlen;		/* 4 bytes of audio in aq		*/
+	uint32_t aqsize;	/* 4 size of aq				*/
+	struct sanmix *mix;	/* 8 PSAD/iMUSE mixer, NULL until needed */
+	/* below are also accessed by the audio worker, keep them separate */
+	uint8_t  quiet;		/* 1 decode only, don't queue audio/video */
+	uint8_t  iactdrop;	/* 1 drop the partial IACT packet in flight */
+	uint8_t  aqdefer;	/* 1 collect audio in aq, queue it later */
+};
+
+/* audio mixer track states */
+#define ACH_FREE	0	/* slot unused				*/
+#define ACH_HDR		1	/* collecting the SAUD/iMUS header	*/
+#define ACH_DATA	2	/* decoding samples			*/
+#define ACH_SKIP	3	/* unplayable, ignore until the next one */
+
+/* a PSAD or iMUSE IACT audio track */
+struct sanachan {
+	int16_t *ring;		/* 8 stereo samples at MIX_RATE, gain applied */
+	uint32_t ringsz;	/* 4 size of ring in stereo frames, 2^n	*/
+	uint32_t rd;		/* 4 ring read position			*/
+	uint32_t wr;		/* 4 ring write position		*/
+	uint32_t key;		/* 4 track id				*/
+	uint32_t left;		/* 4 sample data bytes left in the track */
+	uint32_t step;		/* 4 resampling step, 16.16 fixed point	*/
+	uint32_t phase;		/* 4 resampling position, 16.16		*/
+	int16_t  prev[2];	/* 4 last input frame for resampling	*/
+	int16_t  hs;		/* 2 left sample waiting for the right one */
+	int16_t  gl;		/* 2 left gain, 128 is 1.0		*/
+	int16_t  gr;		/* 2 right gain, 128 is 1.0		*/
+	uint16_t hlen;		/* 2 bytes in hdr			*/
+	uint8_t  part[4];	/* 4 partial sample bytes between packets */
+	uint8_t  npart;		/* 1 bytes in part			*/
+	uint8_t  state;		/* 1 ACH_*				*/
+	uint8_t  bits;		/* 1 8, 12 or 16 bits per sample	*/
+	uint8_t  chans;		/* 1 1 or 2 channels			*/
+	uint8_t  half;		/* 1 hs is valid			*/
+	uint8_t  last;		/* 1 last packet of the track seen	*/
+	uint8_t  hdr[SZ_ACHHDR];	/* track header being collected	*/
+};
+
+/* software mixer for the PSAD/iMUSE tracks; accessed by the audio worker */
+struct sanmix {
+	struct sanachan ch[SANDEC_MAXACHAN];
+	int32_t acc[SZ_MIXBLK * 2];	/* mixing accumulator		*/
+	uint64_t pos;		/* 8 stereo frames mixed so far		*/
+};
+
+/* FRME read-ahead ring slot */
+struct sanraslot {
+	uint8_t *buf;		/* 8 FRME payload			*/
+	uint32_t bufsz;		/* 4 size of buf			*/
+	uint32_t ofs;		/* 4 file offset of the FRME header	*/
+	uint32_t size;		/* 4 FRME payload size			*/
+	int err;		/* 4 read error, last slot of the stream */
+};
+
+/* FRME read-ahead context */
+struct sanra {
+#ifndef SANDEC_NO_THREADS
+	pthread_t thr;		/* reader thread			*/
+	pthread_mutex_t mtx;	/* protects head/count/stop		*/
+	pthread_cond_t cond;	/* slot filled or freed			*/
+#endif
+	struct sanraslot *slot;	/* ring of depth slots			*/
+	uint32_t pos;		/* reader file offset			*/
+	uint16_t depth;		/* number of slots			*/
+	uint16_t head;		/* next slot for the decoder		*/
+	uint16_t count;		/* number of filled slots		*/
+	uint8_t  stop;		/* reader should exit			*/
+	uint8_t  running;	/* reader thread exists			*/
+};
+
+/* a piece of work for the worker pool: a band of a frame, or the audio
+ * of a FRME.
+ */
+struct sanwork {
+	uint8_t *src;		/* 8 input data				*/
+	uint8_t *dst;		/* 8 output				*/
+	uint8_t *ref1;		/* 8 reference image 1			*/
+	uint8_t *ref2;		/* 8 reference image 2			*/
+	uint8_t *tbl;		/* 8 lookup table			*/
+	uint8_t *map;		/* 8 8x8 block map of the band		*/
+	const uint32_t *pal;	/* 8 output format palette, or NULL	*/
+	uint32_t len;		/* 4 size of input data			*/
+	uint16_t w;		/* 2 band width				*/
+	uint16_t h;		/* 2 band height			*/
+	uint8_t bpp;		/* 1 output bytes per pixel		*/
 };
 
+struct sanctx;
+
+/* worker pool job */
+struct sanjob {
+	void(*fn)(struct sanctx *ctx, void *arg);
+	void *arg;
+	int *pending;		/* job group counter, see pool_wait()	*/
+};
+
+/* worker thread pool */
+struct sanpool {
+#ifndef SANDEC_NO_THREADS
+	pthread_t thr[SANDEC_MAXTHREADS];
+	pthread_mutex_t mtx;	/* protects everything below		*/
+	pthread_cond_t cond;	/* job queued or finished		*/
+#endif
+	struct sanjob job[SZ_JOBS];	/* ring of queued jobs		*/
+	uint16_t nthr;		/* number of worker threads		*/
+	uint16_t head;		/* next job to run			*/
+	uint16_t count;		/* number of queued jobs		*/
+	uint8_t  stop;		/* workers should exit			*/
+};
+
+/* a frame held by the caller, see sandec_frame_hold() */
+struct sanfslot {
+	struct sanframe f;	/* what the caller gets to see		*/
+	uint8_t *img;		/* 8 own image buffer in the frame pool	*/
+	uint8_t *arena;		/* 8 frame buffer allocation of img	*/
+	uint32_t pal[256];	/* 1024 palette of the frame		*/
+	uint16_t refs;		/* 2 references held by the caller	*/
+};
+
+/* decoded frame cache entry, followed by the RLE-packed image */
+struct sanfcent {
+	struct sanfcent *prev;	/* 8 LRU list, most recently used first	*/
+	struct sanfcent *next;	/* 8					*/
+	uint32_t frame;		/* 4 frame number			*/
+	uint32_t size;		/* 4 bytes of packed image		*/
+	uint16_t w;		/* 2 frame width/height			*/
+	uint16_t h;		/* 2					*/
+	uint16_t bufw;		/* 2 size of the image, buffer width/height */
+	uint16_t bufh;		/* 2					*/
+	uint16_t subid;		/* 2 subtitle of the frame		*/
+	uint32_t pal[256];	/* 1024 palette of the frame		*/
+};
+
+/* decoded frame cache, see sandec_frame_cache() */
+struct sanfc {
+	struct sanfcent **idx;	/* 8 entries by frame number, or NULL	*/
+	struct sanfcent *head;	/* 8 most recently used			*/
+	struct sanfcent *tail;	/* 8 least recently used		*/
+	uint32_t budget;	/* 4 memory for entries, 0 disables	*/
+	uint32_t used;		/* 4 memory used by entries		*/
+	uint32_t pos;		/* 4 next frame served from the cache	*/
+	int err;		/* 4 decoder status while serving	*/
+	uint8_t  serve;		/* 1 frames come from the cache		*/
+	uint8_t  dirty;		/* 1 palette holds a served one, pal the decoder's */
+	uint32_t pal[256];	/* 1024 decoder palette while serving	*/
+};
+
+#ifdef SANDEC_STATS
+/* bitstream whose opcodes are counted once the codec is done */
+struct sanstops {
+	uint8_t *src;		/* 8 codec data				*/
+	uint16_t w;		/* 2					*/
+	uint16_t h;		/* 2					*/
+	uint8_t  op;		/* 1 ST_OPS_*, 0 none			*/
+	uint8_t  f4;		/* 1 codec37 comp3 flag 4		*/
+	uint8_t  c4;		/* 1 codec37 comp 4			*/
+};
+
+#define ST_OPS_C47	1
+#define ST_OPS_C48	2
+#define ST_OPS_C37C1	3
+#define ST_OPS_C37C3	4
+#endif
+
 /* internal context: static stuff. */
 struct sanctx {
 	struct sanrt rt;
 	struct sanio *io;
 	int errdone;		/* latest error status */
+	struct sanra *ra;	/* FRME read-ahead, or NULL */
+	int radepth;		/* FRME read-ahead queue depth */
+	struct sanpool *pool;	/* worker threads, or NULL */
+	int nframes;		/* frame pool size for next allocation */
+	int decim;		/* pass out every decim'th frame, 0/1 all */
+	int ofmt;		/* SANDEC_FMT_* output format */
+	uint32_t palgen;	/* palette generation, see pal_derive() */
+	uint8_t *obufu;		/* caller's output buffer, or NULL */
+	uint32_t obufusz;	/* size of obufu */
+	int fheld;		/* number of frames held by the caller */
+	struct sanframe qf;	/* last queued image, vdata NULL if none */
+	struct sanfc fc;	/* decoded frame cache */
+	int qslot;		/* slot holding qf, or -1 */
+	struct sanfslot fslot[SANDEC_MAXFRAMES];
+	uint8_t *fold[SANDEC_MAXFRAMES];	/* old allocations with held frames */
+#ifdef SANDEC_STATS
+	struct sanstats st;	/* stage timing, see sandec_get_stats() */
+	void(*trace)(void *userctx, int stage, uint64_t start, uint64_t ns);
+	struct sanstops stops;	/* opcodes to count after the codec */
+#endif
 
 	/* codec47 static data */
 	int8_t c47_glyph4x4[NGLYPHS][16];
 	int8_t c47_glyph8x8[NGLYPHS][64];
 };
 
+#ifdef SANDEC_STATS
+static uint64_t st_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* note the bitstream of the codec for st_ops(), if the opcodes are counted */
+static void st_ops_later(struct sanctx *ctx, uint8_t op, uint8_t *src,
+			 uint16_t w, uint16_t h, uint8_t f4, uint8_t c4)
+{
+	struct sanstops *so = &ctx->stops;
+
+	if (!(ctx->io->flags & SANDEC_FLAG_COUNT_OPS))
+		return;
+	so->op = op;
+	so->src = src;
+	so->w = w;
+	so->h = h;
+	so->f4 = f4;
+	so->c4 = c4;
+}
+
+static void st_add(struct sanctx *ctx, int id, uint64_t t0)
+{
+	uint64_t ns = st_now() - t0;
+
+	ctx->st.frame[id].ns += ns;
+	ctx->st.frame[id].count++;
+	ctx->st.total[id].ns += ns;
+	ctx->st.total[id].count++;
+	if (ctx->trace)
+		ctx->trace(ctx->io->userctx, id, t0, ns);
+}
+
+/* time the statement(s) as decoding stage id */
+#define ST_TIME(ctx, id, ...)					\
+	do {							\
+		uint64_t _st0 = st_now();			\
+		__VA_ARGS__;					\
+		st_add(ctx, id, _st0);				\
+	} while (0)
+#define ST_CLEAR(ctx)						\
+	do {							\
+		memset((ctx)->st.frame, 0, sizeof((ctx)->st.frame)); \
+		memset(&(ctx)->st.cframe, 0, sizeof(struct sancounts)); \
+	} while (0)
+/* add n to a counter in struct sancounts */
+#define ST_COUNT(ctx, field, n)					\
+	do {							\
+		(ctx)->st.cframe.field += (n);			\
+		(ctx)->st.ctotal.field += (n);			\
+	} while (0)
+/* code only built for the statistics */
+#define ST_DO(...)		__VA_ARGS__
+#else
+#define ST_TIME(ctx, id, ...)	do { __VA_ARGS__; } while (0)
+#define ST_CLEAR(ctx)		do { } while (0)
+#define ST_COUNT(ctx, field, n)	do { } while (0)
+#define ST_DO(...)
+#endif
+
 /* Codec37/Codec48 motion vectors */
 static const int8_t c37_mv[3][510] = {
 	{
@@ -466,499 +837,1681 @@ static void c47_make_glyphs(int8_t *pglyphs, const int8_t *xvec, const int8_t *y
 /* allocate memory for a full FRME */
 static int allocfrme(struct sanctx *ctx, uint32_t sz)
 {
+	uint8_t *p;
+
 	sz = (sz + 31) & ~31;
 	if (sz > ctx->rt.frmebufsz) {
+		/* the old one stays if there's no memory for the new one */
+		p = (uint8_t *)malloc(sz);
+		if (!p)
+			return 1;
 		if (ctx->rt.fcache)
 			free(ctx->rt.fcache);
-		ctx->rt.fcache = (uint8_t *)malloc(sz);
-		if (!ctx->rt.fcache) {
-			ctx->rt.frmebufsz = 0;
-			return 1;
-		}
+		ctx->rt.fcache = p;
 		ctx->rt.frmebufsz = sz;
+		ST_COUNT(ctx, fcgrow, 1);
 	}
 	return 0;
 }
 
-static inline int read_source(struct sanctx *ctx, void *dst, uint32_t sz)
+/* check that sz bytes are left in the in-memory file */
+static inline int mem_avail(struct sanrt *rt, uint32_t sz)
 {
-	return !(ctx->io->ioread(ctx->io->userctx, dst, sz));
+	return (rt->fpos <= rt->memsize) && (sz <= rt->memsize - rt->fpos);
 }
 
-static void read_palette(struct sanctx *ctx, uint8_t *src)
+static inline int read_source(struct sanctx *ctx, void *dst, uint32_t sz)
 {
 	struct sanrt *rt = &ctx->rt;
-	uint32_t *pal = rt->palette;
-	uint8_t t[12];
-	int i = 0;
 
-	while (i < 256) {
-		t[0] = *src++;
-		t[1] = *src++;
-		t[2] = *src++;
-		*pal++ = 0xff << 24 | t[2] << 16 | t[1] << 8 | t[0];
-		i++;
+	if (rt->mem) {
+		if (!mem_avail(rt, sz))
+			return 1;
+		memcpy(dst, rt->mem + rt->fpos, sz);
+		rt->fpos += sz;
+		return 0;
 	}
+	rt->fpos += sz;
+	return !(ctx->io->ioread(ctx->io->userctx, dst, sz));
 }
 
-static void interpolate_frame(uint8_t *dst, const uint8_t *sr1, const uint8_t *srs,
-			      const uint8_t *itbl, const uint16_t w, const uint16_t h)
+static inline int seek_source(struct sanctx *ctx, uint32_t ofs)
 {
-	int i, j, k;
+	ctx->rt.fpos = ofs;
+	if (ctx->rt.mem)
+		return ofs > ctx->rt.memsize;
+	return !(ctx->io->ioseek(ctx->io->userctx, ofs));
+}
 
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			k = (*sr1++) << 8 | (*srs++);
-			*dst++ = itbl[k];
-		}
-	}
+static inline int can_seek(struct sanctx *ctx)
+{
+	return ctx->rt.mem || ctx->io->ioseek;
 }
 
-/* swap the 3 buffers according to the codec */
-static void c47_swap_bufs(struct sanctx *ctx, uint8_t rotcode)
+/* get sz bytes of the file at the current position: in-memory files are
+ * used in place, otherwise the data is read into the FRME cache.
+ */
+static int map_source(struct sanctx *ctx, uint32_t sz, uint8_t **dst)
 {
 	struct sanrt *rt = &ctx->rt;
-	if (rotcode) {
-		uint8_t *tmp;
-		if (rotcode == 2) {
-			tmp = rt->buf1;
-			rt->buf1 = rt->buf2;
-			rt->buf2 = tmp;
-		}
-		tmp = rt->buf2;
-		rt->buf2 = rt->buf0;
-		rt->buf0 = tmp;
+
+	if (rt->mem) {
+		if (!mem_avail(rt, sz))
+			return 10;
+		*dst = (uint8_t *)rt->mem + rt->fpos;
+		rt->fpos += sz;
+		return 0;
 	}
+	if (allocfrme(ctx, sz))
+		return 1;
+	*dst = rt->fcache;
+	return read_source(ctx, *dst, sz) ? 10 : 0;
 }
 
-static void codec47_comp1(uint8_t *src, uint8_t *dst_in, uint8_t *itbl, uint16_t w, uint16_t h)
+/******************************************************************************/
+/* worker pool */
+
+#ifndef SANDEC_NO_THREADS
+
+/* run the next queued job; called and returns with the pool lock held */
+static void pool_runone(struct sanctx *ctx)
 {
-	/* input data is i-frame with half width and height. combining 2 pixels
-	 * into a 16bit value, one can then use this value as an index into
-	 * the interpolation table to get the missing color between 2 pixels.
-	 */
-	uint8_t *dst, p8, p82;
-	uint16_t px;
-	int i, j;
+	struct sanpool *pl = ctx->pool;
+	struct sanjob j = pl->job[pl->head];
+
+	pl->head = (pl->head + 1) % SZ_JOBS;
+	pl->count--;
+	pthread_mutex_unlock(&pl->mtx);
+	j.fn(ctx, j.arg);
+	pthread_mutex_lock(&pl->mtx);
+	(*j.pending)--;
+	pthread_cond_broadcast(&pl->cond);
+}
 
-	/* start with 2nd row and create every other.  The first 2 pixels in each
-	 * row are taken from the source, the next one is interpolated from the
-	 * last and the following one.
-	 */
-	dst = dst_in + w;
-	for (i = 0; i < h; i += 2) {
-		p8 = *src++;
-		*dst++ = p8;
-		*dst++ = p8;
-		px = p8;
-		for (j = 2; j < w; j += 2) {
-			p8 = *src++;
-			px = (px << 8) | p8;
-			*dst++ = itbl[px];
-			*dst++ = p8;
-		}
-		dst += w;
+static void *pool_thread(void *arg)
+{
+	struct sanctx *ctx = (struct sanctx *)arg;
+	struct sanpool *pl = ctx->pool;
+
+	pthread_mutex_lock(&pl->mtx);
+	while (!pl->stop) {
+		if (pl->count)
+			pool_runone(ctx);
+		else
+			pthread_cond_wait(&pl->cond, &pl->mtx);
 	}
+	pthread_mutex_unlock(&pl->mtx);
 
-	/* do the rows: the first is a copy of the 2nd line, the missing ones
-	 * are interpolated using the pixels of the rows above and below.
-	 */
-	memcpy(dst_in, dst_in + w, w);
-	dst = dst_in + (w * 2);
-	for (i = 2; i < h - 1; i += 2) {
-		for (j = 0; j < w; j ++) {	/* walk along the full row */
-			p8 = *(dst - w);	/* pixel from row above */
-			p82 = *(dst + w);	/* pixel from row below */
-			px = (p82 << 8) | p8;
-			*dst++ = itbl[px];
-		}
-		dst += w;
-	}
+	return NULL;
 }
 
-static uint8_t* codec47_block(struct sanctx *ctx, uint8_t *src, uint8_t *dst,
-			      uint8_t *p1, uint8_t *p2, uint16_t w,
-			      uint8_t *coltbl, uint16_t size)
+/* queue fn(arg) for the workers, and account for it in *pending.  Without
+ * workers, it is run right away.
+ */
+static void pool_run(struct sanctx *ctx, void(*fn)(struct sanctx *, void *),
+		     void *arg, int *pending)
 {
-	uint8_t opc, col[2], c;
-	uint16_t i, j;
-	int8_t *pglyph;
+	struct sanpool *pl = ctx->pool;
+	struct sanjob *j;
 
-	opc = *src++;
-	if (opc >= 0xF8) {
-		switch (opc) {
-		case 0xff:
-			if (size == 2) {
-				*(dst + 0 + 0) = *src++; *(dst + 0 + 1) = *src++;
-				*(dst + w + 0) = *src++; *(dst + w + 1) = *src++;
-			} else {
-				size >>= 1;
-				src = codec47_block(ctx, src, dst, p1, p2, w, coltbl, size);
-				src = codec47_block(ctx, src, dst + size, p1 + size, p2 + size, w, coltbl, size);
-				dst += (size * w);
-				p1 += (size * w);
-				p2 += (size * w);
-				src = codec47_block(ctx, src, dst, p1, p2, w, coltbl, size);
-				src = codec47_block(ctx, src, dst + size, p1 + size, p2 + size, w, coltbl, size);
-			}
-			break;
-		case 0xfe:
-			c = *src++;
-			for (i = 0; i < size; i++)
-				for (j = 0; j < size; j++)
-					*(dst + (i * w) + j) = c;
-			break;
-		case 0xfd:
-			opc = *src++;
-			col[0] = *src++;
-			col[1] = *src++;
-			pglyph = (size == 8) ? ctx->c47_glyph8x8[opc] : ctx->c47_glyph4x4[opc];
-			for (i = 0; i < size; i++)
-				for (j = 0; j < size; j++)
-					*(dst + (i * w) + j) = col[!*pglyph++];
-			break;
-		case 0xfc:
-			for (i = 0; i < size; i++)
-				for (j = 0; j < size; j++)
-					*(dst + (i * w) + j) = *(p1 + (i * w) + j);
-			break;
-		default:
-			c = coltbl[opc & 7];
-			for (i = 0; i < size; i++)
-				for (j = 0; j < size; j++)
-					*(dst + (i * w) + j) = c;
-		}
-	} else {
-		const int32_t mvoff = c47_mv[opc][0] + (c47_mv[opc][1] * w);
-		for (i = 0; i < size; i++)
-			for (j = 0; j < size; j++)
-				*(dst + (i * w) + j) = *(p2 + (i * w) + j + mvoff);
+	if (!pl) {
+		fn(ctx, arg);
+		return;
 	}
-	return src;
+
+	pthread_mutex_lock(&pl->mtx);
+	while (pl->count == SZ_JOBS)
+		pool_runone(ctx);
+	j = &pl->job[(pl->head + pl->count) % SZ_JOBS];
+	j->fn = fn;
+	j->arg = arg;
+	j->pending = pending;
+	(*pending)++;
+	pl->count++;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->mtx);
 }
 
-static void codec47_comp2(struct sanctx *ctx, uint8_t *src, uint8_t *dst,
-			  uint16_t w, uint16_t h, uint8_t *coltbl)
+/* wait until all jobs accounted in *pending are done, helping out with
+ * queued jobs in the meantime.
+ */
+static void pool_wait(struct sanctx *ctx, int *pending)
 {
-	uint8_t *b1 = ctx->rt.buf1, *b2 = ctx->rt.buf2;
-	unsigned int i, j;
+	struct sanpool *pl = ctx->pool;
 
-	for (j = 0; j < h; j += 8) {
-		for (i = 0; i < w; i += 8) {
-			src = codec47_block(ctx, src, dst + i, b1 + i, b2 + i, w, coltbl, 8);
-		}
-		dst += (w * 8);
-		b1 += (w * 8);
-		b2 += (w * 8);
+	if (!pl)
+		return;
+
+	pthread_mutex_lock(&pl->mtx);
+	while (*pending) {
+		if (pl->count)
+			pool_runone(ctx);
+		else
+			pthread_cond_wait(&pl->cond, &pl->mtx);
 	}
+	pthread_mutex_unlock(&pl->mtx);
 }
 
-static void codec47_comp5(uint8_t *src, uint8_t *dst, uint32_t left)
+static void pool_free(struct sanctx *ctx)
 {
-	uint8_t opc, rlen, col, j;
+	struct sanpool *pl = ctx->pool;
+	int i;
 
-	while (left) {
-		opc = *src++;
-		rlen = (opc >> 1) + 1;
-		if (rlen > left)
-			rlen = left;
-		if (opc & 1) {
-			col = *src++;
-			for (j = 0; j < rlen; j++)
-				*dst++ = col;
-		} else {
-			for (j = 0; j < rlen; j++)
-				*dst++ = *src++;
-		}
-		left -= rlen;
-	}
+	if (!pl)
+		return;
+
+	pthread_mutex_lock(&pl->mtx);
+	pl->stop = 1;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->mtx);
+	for (i = 0; i < pl->nthr; i++)
+		pthread_join(pl->thr[i], NULL);
+	pthread_mutex_destroy(&pl->mtx);
+	pthread_cond_destroy(&pl->cond);
+	free(pl);
+	ctx->pool = NULL;
 }
 
-static void codec47_itable(struct sanctx *ctx, uint8_t *src)
+static int pool_init(struct sanctx *ctx, int nthr)
 {
-	uint8_t *itbl, *p1, *p2;
-	int i, j;
+	struct sanpool *pl;
 
-	itbl = ctx->rt.c47ipoltbl;
-	for (i = 0; i < 256; i++) {
-		p1 = p2 = itbl + i;
-		for (j = 256 - i; j; j--) {
-			*p1 = *p2 = *src++;
-			p1 += 1;
-			p2 += 256;
+	pl = (struct sanpool *)malloc(sizeof(struct sanpool));
+	if (!pl)
+		return 1;
+	memset(pl, 0, sizeof(struct sanpool));
+	pthread_mutex_init(&pl->mtx, NULL);
+	pthread_cond_init(&pl->cond, NULL);
+	ctx->pool = pl;
+
+	while (pl->nthr < nthr) {
+		if (pthread_create(&pl->thr[pl->nthr], NULL, pool_thread, ctx)) {
+			pool_free(ctx);
+			return 72;
 		}
-		itbl += 256;
+		pl->nthr++;
 	}
-	ctx->rt.have_itable = 1;
+	return 0;
 }
 
-static int codec47(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h)
+#else
+
+static void pool_run(struct sanctx *ctx, void(*fn)(struct sanctx *, void *),
+		     void *arg, int *pending)
 {
-	uint8_t *insrc = src, *dst, comp, newrot, flag;
-	uint32_t decsize;
-	uint16_t seq;
-	int ret;
+	fn(ctx, arg);
+}
 
-	seq =    le16_to_cpu(*(uint16_t *)(src + 0));
-	comp =   src[2];
-	newrot = src[3];
-	flag =   src[4];
-	decsize  = le32_to_cpu(ua32(src + 14));	/* decoded (raw frame) size */
+static void pool_wait(struct sanctx *ctx, int *pending) {}
+static void pool_free(struct sanctx *ctx) {}
 
-	if (seq == 0) {
-		ctx->rt.lastseq = -1;
-		memset(ctx->rt.buf1, src[12], decsize);
-		memset(ctx->rt.buf2, src[13], decsize);
-	}
-	src += 26;
-	if (flag & 1) {
-		codec47_itable(ctx, src);
-		src += 0x8080;
-	}
+#endif	/* SANDEC_NO_THREADS */
 
-	ret = 0;
-	dst = ctx->rt.buf0;
-	switch (comp) {
-	case 0:	memcpy(dst, src, w * h); break;
-	case 1:	codec47_comp1(src, dst, ctx->rt.c47ipoltbl, w, h); break;
-	case 2:	if (seq == (ctx->rt.lastseq + 1)) {
-			codec47_comp2(ctx, src, dst, w, h, insrc + 8);
-		}
+/* number of bands to split work into: one per worker plus the caller */
+static inline int pool_bands(struct sanctx *ctx)
+{
+	return ctx->pool ? ctx->pool->nthr + 1 : 1;
+}
+
+/******************************************************************************/
+/* block copy/fill kernels for the codecs.  The blocks are 2, 4 or 8 pixels
+ * wide, so each line is moved with a single 16/32/64bit load/store, which
+ * the compiler emits for the fixed-size memcpy()s; wider vector registers
+ * would not help here.
+ */
+
+/* copy a size x size block between 2 buffers with the same stride w */
+static inline void blk_copy(uint8_t *dst, const uint8_t *src, uint16_t w,
+			    const int size)
+{
+	int i;
+
+	switch (size) {
+	case 8:
+		for (i = 0; i < 8; i++, dst += w, src += w)
+			memcpy(dst, src, 8);
+		break;
+	case 4:
+		for (i = 0; i < 4; i++, dst += w, src += w)
+			memcpy(dst, src, 4);
+		break;
+	default:
+		memcpy(dst, src, 2);
+		memcpy(dst + w, src + w, 2);
 		break;
-	case 3:	memcpy(ctx->rt.buf0, ctx->rt.buf2, ctx->rt.fbsize); break;
-	case 4:	memcpy(ctx->rt.buf0, ctx->rt.buf1, ctx->rt.fbsize); break;
-	case 5:	codec47_comp5(src, dst, decsize); break;
-	default: break;
 	}
+}
 
-	if (seq == ctx->rt.lastseq + 1)
-		c47_swap_bufs(ctx, newrot);
+/* fill a size x size block with color c */
+static inline void blk_fill(uint8_t *dst, uint8_t c, uint16_t w, const int size)
+{
+	const uint64_t q = c * 0x0101010101010101ULL;
+	int i;
 
-	ctx->rt.lastseq = seq;
-	if (seq > 1)
-		ctx->rt.can_ipol = 1;
+	switch (size) {
+	case 8:
+		for (i = 0; i < 8; i++, dst += w)
+			memcpy(dst, &q, 8);
+		break;
+	case 4:
+		for (i = 0; i < 4; i++, dst += w)
+			memcpy(dst, &q, 4);
+		break;
+	default:
+		memcpy(dst, &q, 2);
+		memcpy(dst + w, &q, 2);
+		break;
+	}
+}
 
-	return ret;
+/* copy a packed size x size block (stride == size) into dst */
+static inline void blk_put(uint8_t *dst, const uint8_t *src, uint16_t w,
+			   const int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++, dst += w, src += size)
+		memcpy(dst, src, size);
 }
 
 /******************************************************************************/
+/* Images needed later are not copied right away, but only referenced:
+ * the image saved by STOR (rt->stor), the interpolation source (rt->ipref),
+ * the codec37 image in buf0 (rt->b0src) and the frames held by the caller.
+ * Before a buffer is written, buf_touch() copies the images still
+ * referencing it to their own buffers buf3, buf4 or frame slot.  In most
+ * cases this never happens before the reference is dropped or replaced.
+ */
 
-/* scale 4x4 input block to 8x8 output block */
-static void c48_4to8(uint8_t *dst, uint8_t *src, uint16_t w)
+/* copy held frames still in buffer b (or any buffer if NULL) to their slot */
+static void frames_detach(struct sanctx *ctx, uint8_t *b)
 {
-	uint16_t p;
-	/* dst is always aligned, so we can do at least 16bit stores */
-	for (int i = 0; i < 4; i++) {
-		for (int j = 0; j < 8; j += 2) { /* 1px > 2x2 block */
-			p = *src++;
-			p = (p << 8) | p; /* 1x2 line */
-			*((uint16_t *)(dst + w * 0 + j)) = p;  // 0|0
-			*((uint16_t *)(dst + w * 1 + j)) = p;  // 0|1
-		}
-		dst += w * 2;
+	struct sanfslot *fs;
+	int i;
+
+	for (i = 0; i < SANDEC_MAXFRAMES; i++) {
+		fs = &ctx->fslot[i];
+		if (!fs->refs || fs->arena != ctx->rt.buf || fs->f.vdata == fs->img)
+			continue;
+		if (b && fs->f.vdata != b)
+			continue;
+		memcpy(fs->img, fs->f.vdata, fs->f.size);
+		fs->f.vdata = fs->img;
 	}
 }
 
-/* process an 8x8 block */
-static uint8_t *c48_block(uint8_t *src, uint8_t *dst, uint8_t *db, uint16_t w)
+static void buf_touch(struct sanctx *ctx, uint8_t *b)
 {
-	uint8_t opc, sb[16];
-	int16_t mvofs;
-	uint32_t ofs;
-	int i, j, k, l;
+	struct sanrt *rt = &ctx->rt;
 
-	opc = *src++;
-	switch (opc) {
-	case 0xFF:	/* 1x1 -> 8x8 block scale */
-		for (i = 0; i < 16; i++)
-			sb[i] = *src;
-		src++;
-		c48_4to8(dst, sb, w);
-		break;
-	case 0xFE:	/* 1x 8x8 copy from deltabuf, 16bit mv from src */
-		mvofs = (int16_t)le16_to_cpu(ua16(src)); src += 2;
-		for (i = 0; i < 8; i++) {
-			ofs = w * i;
-			for (k = 0; k < 8; k++)
-				*(dst + ofs + k) = *(db + ofs + k + mvofs);
-		}
-		break;
-	case 0xFD:	/* 2x2 -> 8x8 block scale */
-		sb[ 5] = *src++;
-		sb[ 7] = *src++;
-		sb[13] = *src++;
-		sb[15] = *src++;
+	if (ctx->fheld)
+		frames_detach(ctx, b);
+	if (rt->ipref == b && b != rt->buf4) {
+		memcpy(rt->buf4, b, rt->fbsize);
+		rt->ipref = rt->buf4;
+	}
+	if (rt->stor == b && b != rt->buf3) {
+		buf_touch(ctx, rt->buf3);
+		memcpy(rt->buf3, b, rt->fbsize);
+		rt->stor = rt->buf3;
+	}
+}
 
-		sb[0] = sb[1] = sb[4] = sb[5];
-		sb[2] = sb[3] = sb[6] = sb[7];
-		sb[8] = sb[9] = sb[12] = sb[13];
-		sb[10] = sb[11] = sb[14] = sb[15];
-		c48_4to8(dst, sb, w);
-		break;
-	case 0xFC:	/* 4x copy 4x4 block, per-block c48_mv, index from source */
-		for (i = 0; i < 8; i += 4) {
-			for (k = 0; k < 8; k += 4) {
-				opc = *src++;
-				mvofs = c37_mv[0][opc * 2] + (c37_mv[0][opc * 2 + 1] * w);
-				for (j = 0; j < 4; j++) {
-					ofs = (w * (j + i)) + k;
-					for (l = 0; l < 4; l++)
-						*(dst + ofs + l) = *(db + ofs + l + mvofs);
-				}
-			}
-		}
-		break;
-	case 0xFB: 	/* Copy 4x 4x4 blocks, per-block mv from source */
-		for (i = 0; i < 8; i += 4) {			/* 2 */
-			for (k = 0; k < 8; k += 4) {		/* 2 */
-				mvofs = le16_to_cpu(ua16(src)); src += 2;
-				for (j = 0; j < 4; j++) {	/* 4 */
-					ofs = (w * (j + i)) + k;
-					for (l = 0; l < 4; l++)
-						*(dst + ofs + l) = *(db + ofs + l + mvofs);
-				}
-			}
-		}
-		break;
-	case 0xFA:	/* scale 4x4 input block to 8x8 dest block */
-		c48_4to8(dst, src, w);
-		src += 16;
-		break;
-	case 0xF9:	/* 16x 2x2 copy from delta, per-block c48_mv */
-		for (i = 0; i < 8; i += 2) {				/* 4 */
-			for (j = 0; j < 8; j += 2) {			/* 4 */
-				ofs = (w * i) + j;
-				opc = *src++;
-				mvofs = c37_mv[0][opc * 2] + (c37_mv[0][opc * 2 + 1] * w);
-				for (l = 0; l < 2; l++) {
-					*(dst + ofs + l + 0) = *(db + ofs + l + 0 + mvofs);
-					*(dst + ofs + l + w) = *(db + ofs + l + w + mvofs);
-				}
-			}
-		}
-		break;
-	case 0xF8:	/* 16x 2x2 blocks copy, mv from source */
-		for (i = 0; i < 8; i += 2) {				/* 4 */
-			for (j = 0; j < 8; j += 2) {			/* 4 */
-				ofs = w * i + j;
-				mvofs = le16_to_cpu(ua16(src)); src += 2;
-				for (l = 0; l < 2; l++) {
-					*(dst + ofs + l + 0) = *(db + ofs + l + 0 + mvofs);
-					*(dst + ofs + l + w) = *(db + ofs + l + w + mvofs);
-				}
-			}
-		}
-		break;
-	case 0xF7:	/* copy 8x8 block from src to dest */
-		for (i = 0; i < 8; i++) {
-			ofs = i * w;
-			for (l = 0; l < 8; l++)
-				*(dst + ofs + l) = *src++;
-		}
-		break;
-	default:	/* copy 8x8 block from prev, c48_mv */
-		mvofs = c37_mv[0][opc * 2] + (c37_mv[0][opc * 2 + 1] * w);
-		for (i = 0; i < 8; i++) {
-			ofs = i * w;
-			for (l = 0; l < 8; l++)
-				*(dst + ofs + l) = *(db + ofs + l + mvofs);
-		}
-		break;
+/* buf0 is about to be written, get the codec37 image into it */
+static void buf0_sync(struct sanctx *ctx)
+{
+	struct sanrt *rt = &ctx->rt;
+
+	buf_touch(ctx, rt->buf0);
+	if (rt->b0src) {
+		memcpy(rt->buf0, rt->b0src, rt->fbsize);
+		if (rt->vbuf == rt->b0src)
+			rt->vbuf = rt->buf0;
+		rt->b0src = NULL;
 	}
-	return src;
 }
 
-static void codec48_comp3(uint8_t *src, uint8_t *dst, uint8_t *db,
-			  uint8_t *itbl, uint16_t w, uint16_t h)
+/* the frame buffer allocation is going away: keep it around if the caller
+ * still holds frames in it.
+ */
+static void frames_drop_arena(struct sanctx *ctx, uint8_t *arena)
 {
-	int i, j;
+	int i;
 
-	for (i = 0; i < h; i += 8) {
-		for (j = 0; j < w; j += 8) {
-			src = c48_block(src, dst + j, db + j, w);
+	for (i = 0; i < SANDEC_MAXFRAMES; i++) {
+		if (ctx->fslot[i].refs && ctx->fslot[i].arena == arena)
+			break;
+	}
+	if (i == SANDEC_MAXFRAMES) {
+		free(arena);
+		return;
+	}
+	for (i = 0; i < SANDEC_MAXFRAMES; i++) {
+		if (!ctx->fold[i]) {
+			ctx->fold[i] = arena;
+			return;
 		}
-		dst += w * 8;
-		db += w * 8;
 	}
 }
 
-static int codec48(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h)
+/* all buffers were cleared */
+static void buf_reset(struct sanrt *rt)
 {
-	uint8_t comp, flag, *dst;
-	uint32_t pktsize, decsize;
-	uint16_t seq;
-	int ret;
-
-	comp =	src[0];		/* subcodec */
-	if (src[1] != 1)	/* mvec table variant, always 1 with MotS */
-		return 26;
+	rt->stor = rt->buf3;
+	rt->ipref = rt->buf4;
+	rt->b0src = NULL;
+}
 
-	seq = le16_to_cpu(*(uint16_t*)(src + 2));
+/******************************************************************************/
 
-	/* decsize is the size of the raw frame aligned to 8x8 blocks
-	 * when seq == 0, otherwise it's identical to pktsize, which
-	 * indicates the number of bytes in the datastream for this packet.
-	 */
-	decsize = le32_to_cpu(ua32(src + 4));
-	pktsize = le32_to_cpu(ua32(src + 8));
-	flag =	src[12];
+static void read_palette(struct sanctx *ctx, uint8_t *src)
+{
+	struct sanrt *rt = &ctx->rt;
+	uint32_t *pal = rt->palette;
+	uint8_t t[12];
+	int i = 0;
 
-	if (seq == 0) {
-		ctx->rt.lastseq = -1;
-		memset(ctx->rt.buf0, 0, decsize);
-		memset(ctx->rt.buf2, 0, decsize);
+	while (i < 256) {
+		t[0] = *src++;
+		t[1] = *src++;
+		t[2] = *src++;
+		*pal++ = 0xff << 24 | t[2] << 16 | t[1] << 8 | t[0];
+		i++;
 	}
+	rt->cmap_all = 1;
+	ctx->palgen++;
+}
 
-	src += 16;
-	if (flag & 8) {
-		codec47_itable(ctx, src);
-		src += 0x8080;
-	}
+/******************************************************************************/
+/* change tracking for sanio.queue_video_rects(): cmap has a byte per 4x4
+ * pixel cell, nonzero if the cell differs from the image last queued.
+ * The codecs fill it relative to the buffer which had that image.
+ */
 
-	ret = 0;
-	dst = ctx->rt.buf0;
-	switch (comp) {
-	case 0:	memcpy(dst, src, pktsize); break;
-	case 2: codec47_comp5(src, dst, decsize); break;
-	case 3: codec48_comp3(src, dst, ctx->rt.buf2, ctx->rt.c47ipoltbl, w, h); break;
-	case 5: codec47_comp1(src, dst, ctx->rt.c47ipoltbl, w, h); break;
-	default: break;
+/* the image in buffer base is about to be changed */
+static void cmap_use(struct sanrt *rt, uint8_t *base)
+{
+	if (rt->cmap_all)
+		return;
+	if (!rt->cmapref) {
+		rt->cmapref = base;
+		memset(rt->cmap, 0, ((rt->bufw + 3) >> 2) * ((rt->bufh + 3) >> 2));
+	} else if (rt->cmapref != base) {
+		rt->cmap_all = 1;
 	}
+}
 
-	if (seq > 1)
-		ctx->rt.can_ipol = 1;
-	ctx->rt.lastseq = seq;
-	c47_swap_bufs(ctx, 1);	/* swap 0 and 2 */
+/* mark an area of the image as changed */
+static void cmap_rect(struct sanrt *rt, int x, int y, int w, int h)
+{
+	const int cw = (rt->bufw + 3) >> 2;
+	int x1, y1;
 
-	return ret;
+	if (rt->cmap_all)
+		return;
+	x1 = _min(x + w, rt->bufw);
+	y1 = _min(y + h, rt->bufh);
+	x = _max(x, 0);
+	y = _max(y, 0);
+	if (x >= x1 || y >= y1)
+		return;
+	x1 = (x1 + 3) >> 2;
+	y1 = (y1 + 3) >> 2;
+	for (y >>= 2; y < y1; y++)
+		memset(rt->cmap + y * cw + (x >> 2), 1, x1 - (x >> 2));
 }
 
-/******************************************************************************/
+/* take the changes from the c47/c48 8x8 block map */
+static void cmap_from_dmap(struct sanrt *rt)
+{
+	const int cw = (rt->bufw + 3) >> 2, ch = (rt->bufh + 3) >> 2;
+	const int bw = (rt->bufw + 7) >> 3;
+	uint8_t *c = rt->cmap;
+	int x, y;
+
+	for (y = 0; y < ch; y++, c += cw)
+		for (x = 0; x < cw; x++)
+			c[x] = rt->dmap[(y >> 1) * bw + (x >> 1)];
+}
 
-static void codec37_comp1(uint8_t *src, uint8_t *dst, uint8_t *db, uint16_t w,
-			  uint16_t h, uint8_t mvidx)
+/* bounding box of all changed cells */
+static int cmap_bbox(struct sanrt *rt)
 {
-	uint8_t opc, run, skip;
-	int32_t mvofs, ofs;
-	int i, j, k, l, len;
+	const int cw = (rt->bufw + 3) >> 2, ch = (rt->bufh + 3) >> 2;
+	int x, y, x0 = cw, y0 = ch, x1 = 0, y1 = 0;
+	uint8_t *c = rt->cmap;
+
+	for (y = 0; y < ch; y++, c += cw) {
+		for (x = 0; x < cw; x++) {
+			if (c[x]) {
+				x0 = _min(x0, x);
+				x1 = _max(x1, x + 1);
+				y0 = _min(y0, y);
+				y1 = y + 1;
+			}
+		}
+	}
+	rt->rects[0].x = x0 << 2;
+	rt->rects[0].y = y0 << 2;
+	rt->rects[0].w = (x1 - x0) << 2;
+	rt->rects[0].h = (y1 - y0) << 2;
+	return 1;
+}
 
-	run = 0;
-	len = -1;
-	opc = 0;
-	for (i = 0; i < h; i += 4) {
-		for (j = 0; j < w; j += 4) {
-			if (len < 0) {
-				len = (*src) >> 1;
-				run = !!((*src++) & 1);
-				skip = 0;
-			} else {
-				skip = run;
+/* build the list of changed rectangles from the change map.  Runs of
+ * changed cells are merged with a rectangle of the same span directly
+ * above.  If there are too many, their bounding box is used instead.
+ */
+static int cmap_rects(struct sanrt *rt)
+{
+	const int cw = (rt->bufw + 3) >> 2, ch = (rt->bufh + 3) >> 2;
+	struct sanrect *r = rt->rects;
+	uint8_t *c = rt->cmap;
+	int x, x0, y, i, n = 0;
+
+	for (y = 0; y < ch; y++, c += cw) {
+		for (x = 0; x < cw; ) {
+			if (!c[x]) {
+				x++;
+				continue;
+			}
+			for (x0 = x; x < cw && c[x]; x++)
+				;
+			for (i = n - 1; i >= 0; i--) {
+				if (r[i].y + r[i].h == (y << 2) && r[i].x == (x0 << 2)
+				    && r[i].w == ((x - x0) << 2))
+					break;
+			}
+			if (i >= 0) {
+				r[i].h += 4;
+				continue;
+			}
+			if (n == SZ_RECTS) {
+				n = cmap_bbox(rt);
+				goto clip;
 			}
+			r[n].x = x0 << 2;
+			r[n].y = y << 2;
+			r[n].w = (x - x0) << 2;
+			r[n].h = 4;
+			n++;
+		}
+	}
 
-			if (!skip) {
-				opc = *src++;
-				if (opc == 0xff) {
-					len--;
+clip:
+	/* clip to the visible image */
+	for (i = 0, x = 0; i < n; i++) {
+		if (r[i].x >= rt->frmw || r[i].y >= rt->frmh)
+			continue;
+		r[x] = r[i];
+		r[x].w = _min(r[x].w, rt->frmw - r[x].x);
+		r[x].h = _min(r[x].h, rt->frmh - r[x].y);
+		x++;
+	}
+	return x;
+}
+
+/* check whether the interpolation table maps 2 identical pixels to the
+ * same color.  This holds for all tables seen so far.
+ */
+static int ipol_ident(const uint8_t *itbl)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		if (itbl[i << 8 | i] != i)
+			return 0;
+	return 1;
+}
+
+/* interpolate n pixels between 2 lines, 8 at a time.  Parts of the frame
+ * which did not change are common, with an identity table these are just
+ * copied instead of looked up.
+ * The table is symmetric (see codec47_itable()), so the order of the 2
+ * lines does not matter.
+ */
+static void ipol_line(uint8_t *dst, const uint8_t *sr1, const uint8_t *srs,
+		      const uint8_t *itbl, const int n, const int ident)
+{
+	uint64_t q1, q2;
+	int j = 0;
+
+	for (; j + 8 <= n; j += 8, dst += 8, sr1 += 8, srs += 8) {
+		memcpy(&q1, sr1, 8);
+		memcpy(&q2, srs, 8);
+		if (ident && q1 == q2) {
+			memcpy(dst, &q1, 8);
+			continue;
+		}
+		dst[0] = itbl[sr1[0] << 8 | srs[0]];
+		dst[1] = itbl[sr1[1] << 8 | srs[1]];
+		dst[2] = itbl[sr1[2] << 8 | srs[2]];
+		dst[3] = itbl[sr1[3] << 8 | srs[3]];
+		dst[4] = itbl[sr1[4] << 8 | srs[4]];
+		dst[5] = itbl[sr1[5] << 8 | srs[5]];
+		dst[6] = itbl[sr1[6] << 8 | srs[6]];
+		dst[7] = itbl[sr1[7] << 8 | srs[7]];
+	}
+	for (; j < n; j++)
+		*dst++ = itbl[(*sr1++) << 8 | (*srs++)];
+}
+
+/* interpolate a frame between sr1 and srs.  If a block map is given,
+ * the blocks which are identical in both are copied from srs.
+ */
+static void interpolate_frame(uint8_t *dst, const uint8_t *sr1, const uint8_t *srs,
+			      const uint8_t *itbl, const uint8_t *dmap,
+			      const uint16_t w, const uint16_t h)
+{
+	const int ident = ipol_ident(itbl);
+	const int bw = (w + 7) >> 3;
+	const uint8_t *dm;
+	int i, x, n, o, len;
+
+	if (!ident)
+		dmap = NULL;
+
+	for (i = 0; i < h; i++) {
+		if (!dmap) {
+			ipol_line(dst, sr1, srs, itbl, w, ident);
+		} else {
+			dm = dmap + (i >> 3) * bw;
+			for (x = 0; x < bw; x += n) {
+				/* run of blocks with the same state */
+				for (n = 1; (x + n < bw) && (!dm[x + n] == !dm[x]); n++)
+					;
+				o = x << 3;
+				len = _min(n << 3, w - o);
+				if (dm[x])
+					ipol_line(dst + o, sr1 + o, srs + o, itbl, len, 1);
+				else
+					memcpy(dst + o, srs + o, len);
+			}
+		}
+		dst += w;
+		sr1 += w;
+		srs += w;
+	}
+}
+
+/* palette lookup of n pixels into the output format, 8 at a time */
+static void pal_line(uint8_t *dst, const uint8_t *src, const uint32_t *opal,
+		     const int n, const int bpp)
+{
+	int j = 0;
+
+	if (bpp == 4) {
+		uint32_t *d = (uint32_t *)dst;
+		for (; j + 8 <= n; j += 8, d += 8, src += 8) {
+			d[0] = opal[src[0]];
+			d[1] = opal[src[1]];
+			d[2] = opal[src[2]];
+			d[3] = opal[src[3]];
+			d[4] = opal[src[4]];
+			d[5] = opal[src[5]];
+			d[6] = opal[src[6]];
+			d[7] = opal[src[7]];
+		}
+		for (; j < n; j++)
+			*d++ = opal[*src++];
+	} else {
+		uint16_t *d = (uint16_t *)dst;
+		for (; j + 8 <= n; j += 8, d += 8, src += 8) {
+			d[0] = opal[src[0]];
+			d[1] = opal[src[1]];
+			d[2] = opal[src[2]];
+			d[3] = opal[src[3]];
+			d[4] = opal[src[4]];
+			d[5] = opal[src[5]];
+			d[6] = opal[src[6]];
+			d[7] = opal[src[7]];
+		}
+		for (; j < n; j++)
+			*d++ = opal[*src++];
+	}
+}
+
+/* ipol_line() and pal_line() in one go */
+static void ipol_line_pal(uint8_t *dst, const uint8_t *sr1, const uint8_t *srs,
+			  const uint8_t *itbl, const uint32_t *opal,
+			  const int n, const int bpp)
+{
+	int j = 0;
+
+	if (bpp == 4) {
+		uint32_t *d = (uint32_t *)dst;
+		for (; j + 4 <= n; j += 4, d += 4, sr1 += 4, srs += 4) {
+			d[0] = opal[itbl[sr1[0] << 8 | srs[0]]];
+			d[1] = opal[itbl[sr1[1] << 8 | srs[1]]];
+			d[2] = opal[itbl[sr1[2] << 8 | srs[2]]];
+			d[3] = opal[itbl[sr1[3] << 8 | srs[3]]];
+		}
+		for (; j < n; j++)
+			*d++ = opal[itbl[(*sr1++) << 8 | (*srs++)]];
+	} else {
+		uint16_t *d = (uint16_t *)dst;
+		for (; j + 4 <= n; j += 4, d += 4, sr1 += 4, srs += 4) {
+			d[0] = opal[itbl[sr1[0] << 8 | srs[0]]];
+			d[1] = opal[itbl[sr1[1] << 8 | srs[1]]];
+			d[2] = opal[itbl[sr1[2] << 8 | srs[2]]];
+			d[3] = opal[itbl[sr1[3] << 8 | srs[3]]];
+		}
+		for (; j < n; j++)
+			*d++ = opal[itbl[(*sr1++) << 8 | (*srs++)]];
+	}
+}
+
+/* interpolate a frame between sr1 and srs directly into the output format.
+ * If a block map is given, dst already has the blocks which are identical
+ * in both, from the last image.
+ */
+static void interpolate_frame_pal(uint8_t *dst, const uint8_t *sr1,
+				  const uint8_t *srs, const uint8_t *itbl,
+				  const uint8_t *dmap, const uint32_t *opal,
+				  const int bpp, const uint16_t w, const uint16_t h)
+{
+	const int bw = (w + 7) >> 3;
+	const uint8_t *dm;
+	int i, x, n, o;
+
+	for (i = 0; i < h; i++) {
+		if (!dmap) {
+			ipol_line_pal(dst, sr1, srs, itbl, opal, w, bpp);
+		} else {
+			dm = dmap + (i >> 3) * bw;
+			for (x = 0; x < bw; x += n) {
+				/* run of blocks with the same state */
+				for (n = 1; (x + n < bw) && (!dm[x + n] == !dm[x]); n++)
+					;
+				o = x << 3;
+				if (dm[x])
+					ipol_line_pal(dst + o * bpp, sr1 + o, srs + o, itbl,
+						      opal, _min(n << 3, w - o), bpp);
+			}
+		}
+		dst += w * bpp;
+		sr1 += w;
+		srs += w;
+	}
+}
+
+static void interpolate_band(struct sanctx *ctx, void *arg)
+{
+	struct sanwork *wk = (struct sanwork *)arg;
+
+	if (wk->pal)
+		interpolate_frame_pal(wk->dst, wk->ref1, wk->ref2, wk->tbl,
+				      wk->map, wk->pal, wk->bpp, wk->w, wk->h);
+	else
+		interpolate_frame(wk->dst, wk->ref1, wk->ref2, wk->tbl,
+				  wk->map, wk->w, wk->h);
+}
+
+/* interpolate a frame, split into horizontal bands over the worker pool.
+ * With opal, dst is in the output format with bpp bytes per pixel.
+ */
+static void interpolate_frame_mt(struct sanctx *ctx, uint8_t *dst, uint8_t *sr1,
+				 uint8_t *srs, uint8_t *itbl, uint8_t *dmap,
+				 const uint32_t *opal, int bpp,
+				 uint16_t w, uint16_t h)
+{
+	struct sanwork wk[SANDEC_MAXTHREADS + 1];
+	int i, y, bh, pending = 0;
+	uint32_t ofs;
+
+	if (!opal)
+		bpp = 1;
+	/* whole block rows per band, for the block map */
+	bh = ((((h + 7) >> 3) + pool_bands(ctx) - 1) / pool_bands(ctx)) << 3;
+	for (i = 0, y = 0; y < h; i++, y += bh) {
+		ofs = y * w;
+		wk[i].map = dmap ? dmap + (y >> 3) * ((w + 7) >> 3) : NULL;
+		wk[i].dst = dst + ofs * bpp;
+		wk[i].ref1 = sr1 + ofs;
+		wk[i].ref2 = srs + ofs;
+		wk[i].tbl = itbl;
+		wk[i].pal = opal;
+		wk[i].bpp = bpp;
+		wk[i].w = w;
+		wk[i].h = (h - y) < bh ? (h - y) : bh;
+		pool_run(ctx, interpolate_band, &wk[i], &pending);
+	}
+	pool_wait(ctx, &pending);
+}
+
+static void convert_band(struct sanctx *ctx, void *arg)
+{
+	struct sanwork *wk = (struct sanwork *)arg;
+
+	pal_line(wk->dst, wk->src, wk->pal, wk->len, wk->bpp);
+}
+
+/* convert a whole image to the output format, over the worker pool */
+static void convert_frame_mt(struct sanctx *ctx, uint8_t *dst, uint8_t *src,
+			     const uint32_t *opal, int bpp, uint32_t size)
+{
+	struct sanwork wk[SANDEC_MAXTHREADS + 1];
+	uint32_t ofs, bs;
+	int i, pending = 0;
+
+	bs = ((size / pool_bands(ctx)) + 63) & ~63;
+	for (i = 0, ofs = 0; ofs < size; i++, ofs += bs) {
+		wk[i].src = src + ofs;
+		wk[i].dst = dst + ofs * bpp;
+		wk[i].pal = opal;
+		wk[i].bpp = bpp;
+		wk[i].len = _min(bs, size - ofs);
+		pool_run(ctx, convert_band, &wk[i], &pending);
+	}
+	pool_wait(ctx, &pending);
+}
+
+/* YUV 4:2:0 planes of the w * h image in out */
+static void yuv_planes(uint8_t *out, int fmt, uint16_t w, uint16_t h,
+		       uint8_t **u, uint8_t **v, int *cp)
+{
+	const int cw = (w + 1) >> 1, ch = (h + 1) >> 1;
+
+	*u = out + w * h;
+	if (fmt == SANDEC_FMT_NV12) {
+		*v = *u + 1;
+		*cp = cw * 2;
+	} else {
+		*v = *u + cw * ch;
+		*cp = cw;
+	}
+}
+
+/* convert the area x0-x1/y0-y1 (even x0, y0) of the w * h image img to
+ * YUV 4:2:0, with Y | U << 8 | V << 24 in the table.  The chroma values
+ * are the average of each 2x2 pixel block.
+ */
+static void yuv_area(uint8_t *out, const uint8_t *img, const uint32_t *tbl,
+		     int fmt, uint16_t w, uint16_t h,
+		     int x0, int y0, int x1, int y1)
+{
+	const uint8_t *r0, *r1;
+	uint8_t *y, *u, *v;
+	uint32_t a, b, c, d;
+	int i, j, cp, cs;
+
+	yuv_planes(out, fmt, w, h, &u, &v, &cp);
+	cs = (fmt == SANDEC_FMT_NV12) ? 2 : 1;
+
+	for (i = y0; i < y1; i += 2) {
+		r0 = img + i * w;
+		r1 = (i + 1 < h) ? r0 + w : r0;
+		y = out + i * w;
+		for (j = x0; j < x1; j += 2) {
+			a = tbl[r0[j]];
+			c = tbl[r1[j]];
+			b = (j + 1 < w) ? tbl[r0[j + 1]] : a;
+			d = (j + 1 < w) ? tbl[r1[j + 1]] : c;
+			y[j] = a;
+			if (j + 1 < w)
+				y[j + 1] = b;
+			if (i + 1 < h) {
+				y[j + w] = c;
+				if (j + 1 < w)
+					y[j + w + 1] = d;
+			}
+			/* U and V sums of the 4 pixels in one go */
+			a = ((a >> 8) & 0xff00ff) + ((b >> 8) & 0xff00ff)
+			    + ((c >> 8) & 0xff00ff) + ((d >> 8) & 0xff00ff)
+			    + 0x20002;
+			u[(i >> 1) * cp + (j >> 1) * cs] = a >> 2;
+			v[(i >> 1) * cp + (j >> 1) * cs] = a >> 18;	/* (a >> 16) / 4 */
+		}
+	}
+}
+
+static void convert_yuv_band(struct sanctx *ctx, void *arg)
+{
+	struct sanwork *wk = (struct sanwork *)arg;
+
+	yuv_area(wk->dst, wk->src, wk->pal, ctx->ofmt, wk->w, ctx->rt.bufh,
+		 0, wk->len, wk->w, wk->len + wk->h);
+}
+
+/* convert a whole image to YUV 4:2:0, over the worker pool */
+static void convert_yuv_mt(struct sanctx *ctx, uint8_t *dst, uint8_t *src,
+			   const uint32_t *tbl, uint16_t w, uint16_t h)
+{
+	struct sanwork wk[SANDEC_MAXTHREADS + 1];
+	int i, y, bh, pending = 0;
+
+	bh = ((h / pool_bands(ctx)) + 1) & ~1;
+	if (bh < 2)
+		bh = 2;
+	for (i = 0, y = 0; y < h; i++, y += bh) {
+		wk[i].src = src;
+		wk[i].dst = dst;
+		wk[i].pal = tbl;
+		wk[i].len = y;
+		wk[i].w = w;
+		wk[i].h = _min(bh, h - y);
+		pool_run(ctx, convert_yuv_band, &wk[i], &pending);
+	}
+	pool_wait(ctx, &pending);
+}
+
+/* bytes per pixel of an RGB format, 0 for the others */
+static int fmt_bpp(int fmt)
+{
+	switch (fmt) {
+	case SANDEC_FMT_ARGB8888:
+	case SANDEC_FMT_XRGB8888: return 4;
+	case SANDEC_FMT_RGB565: return 2;
+	default: return 0;
+	}
+}
+
+/* size of a w * h image in the output format, 0 for INDEX8 */
+static uint32_t fmt_size(int fmt, uint16_t w, uint16_t h)
+{
+	if (fmt == SANDEC_FMT_I420 || fmt == SANDEC_FMT_NV12)
+		return w * h + ((w + 1) >> 1) * ((h + 1) >> 1) * 2;
+	return w * h * fmt_bpp(fmt);
+}
+
+/* the palette in format fmt, or the palette to YUV table.  Each palette
+ * change bumps the palette generation, the converted palettes are cached
+ * until it changes again.
+ */
+static const uint32_t *pal_derive(struct sanctx *ctx, int fmt)
+{
+	const uint32_t *pal = ctx->rt.palette;
+	uint32_t *opal, r, g, b, y, u, v;
+	int i, k;
+
+	if (fmt == SANDEC_FMT_INDEX8)
+		return pal;
+	k = (fmt == SANDEC_FMT_NV12 ? SANDEC_FMT_I420 : fmt) - 1;
+	opal = ctx->rt.dpal + (k * 256);
+	if (ctx->rt.dpalgen[k] == ctx->palgen)
+		return opal;
+	ctx->rt.dpalgen[k] = ctx->palgen;
+
+	for (i = 0; i < 256; i++) {
+		r = (pal[i] >>  0) & 0xff;
+		g = (pal[i] >>  8) & 0xff;
+		b = (pal[i] >> 16) & 0xff;
+		switch (fmt) {
+		case SANDEC_FMT_ARGB8888:
+			opal[i] = 0xffU << 24 | r << 16 | g << 8 | b; break;
+		case SANDEC_FMT_XRGB8888:
+			opal[i] = r << 16 | g << 8 | b; break;
+		case SANDEC_FMT_RGB565:
+			opal[i] = (r >> 3) << 11 | (g >> 2) << 5 | (b >> 3); break;
+		default:
+			/* BT.601, limited range */
+			y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+			u = (112 * b - 38 * r - 74 * g + 32896) >> 8;
+			v = (112 * r - 94 * g - 18 * b + 32896) >> 8;
+			opal[i] = y | u << 8 | v << 24;
+			break;
+		}
+	}
+	return opal;
+}
+
+/* convert img to the output format.  If the output buffer has the image
+ * last queued, only the n changed areas are done.
+ */
+static uint8_t *convert_image(struct sanctx *ctx, uint8_t *img, int n)
+{
+	struct sanrt *rt = &ctx->rt;
+	uint8_t *out = ctx->obufu ? ctx->obufu : rt->obuf;
+	const int bpp = rt->obpp;
+	const uint32_t *opal;
+	struct sanrect *r;
+	uint32_t ofs;
+	int i, y;
+
+	if (rt->oready) {	/* done by the interpolation */
+		rt->oready = 0;
+		rt->olast = out;
+		return out;
+	}
+
+	opal = pal_derive(ctx, ctx->ofmt);
+	buf_touch(ctx, out);
+	if (!bpp) {	/* YUV */
+		if (n < 0 || rt->olast != out) {
+			convert_yuv_mt(ctx, out, img, opal, rt->bufw, rt->bufh);
+		} else {
+			/* extend the areas to whole 2x2 blocks */
+			for (i = 0, r = rt->rects; i < n; i++, r++)
+				yuv_area(out, img, opal, ctx->ofmt,
+					 rt->bufw, rt->bufh, r->x & ~1, r->y & ~1,
+					 _min((r->x + r->w + 1) & ~1, rt->bufw),
+					 _min((r->y + r->h + 1) & ~1, rt->bufh));
+		}
+	} else if (n < 0 || rt->olast != out) {
+		convert_frame_mt(ctx, out, img, opal, bpp, rt->fbsize);
+	} else {
+		for (i = 0, r = rt->rects; i < n; i++, r++) {
+			for (y = 0; y < r->h; y++) {
+				ofs = (r->y + y) * rt->bufw + r->x;
+				pal_line(out + ofs * bpp, img + ofs, opal,
+					 r->w, bpp);
+			}
+		}
+	}
+	rt->olast = out;
+	return out;
+}
+
+/* hand an image to the caller.  With sanio.queue_video_rects() set, the
+ * changed areas are passed along if known (changes), or the full image.
+ */
+static void queue_image(struct sanctx *ctx, uint8_t *img, uint32_t dur,
+			int changes)
+{
+	struct sanrt *rt = &ctx->rt;
+	struct sanio *io = ctx->io;
+	uint32_t size = rt->fbsize;
+	int n = -1;
+
+	if (changes && (io->queue_video_rects || rt->osize))
+		n = cmap_rects(rt);
+	if (rt->osize) {
+		ST_TIME(ctx, SANDEC_ST_OUTPUT, img = convert_image(ctx, img, n));
+		size = rt->osize;
+	}
+
+	/* remember it for sandec_frame_hold() */
+	ctx->qf.vdata = img;
+	ctx->qf.size = size;
+	ctx->qf.w = rt->frmw;
+	ctx->qf.h = rt->frmh;
+	ctx->qf.subid = rt->subid;
+	ctx->qf.frame_duration_us = dur;
+	ctx->qf.palgen = ctx->palgen;
+	ctx->qslot = -1;
+
+	if (!io->queue_video_rects) {
+		io->queue_video(io->userctx, img, size, rt->frmw,
+				rt->frmh, rt->palette, rt->subid, dur);
+		return;
+	}
+
+	if (n < 0) {		/* changes unknown */
+		rt->rects[0].x = 0;
+		rt->rects[0].y = 0;
+		rt->rects[0].w = rt->frmw;
+		rt->rects[0].h = rt->frmh;
+		n = 1;
+	}
+	io->queue_video_rects(io->userctx, img, size, rt->frmw, rt->frmh,
+			      rt->palette, rt->subid, dur, rt->rects, n);
+}
+
+/* swap the 3 buffers according to the codec */
+static void c47_swap_bufs(struct sanctx *ctx, uint8_t rotcode)
+{
+	struct sanrt *rt = &ctx->rt;
+	if (rotcode) {
+		uint8_t *tmp;
+		if (rotcode == 2) {
+			tmp = rt->buf1;
+			rt->buf1 = rt->buf2;
+			rt->buf2 = tmp;
+		}
+		tmp = rt->buf2;
+		rt->buf2 = rt->buf0;
+		rt->buf0 = tmp;
+	}
+}
+
+static void codec47_comp1(uint8_t *src, uint8_t *dst_in, uint8_t *itbl, uint16_t w, uint16_t h)
+{
+	/* input data is i-frame with half width and height. combining 2 pixels
+	 * into a 16bit value, one can then use this value as an index into
+	 * the interpolation table to get the missing color between 2 pixels.
+	 */
+	const int ident = ipol_ident(itbl);
+	uint8_t *dst, p8;
+	uint16_t px;
+	int i, j;
+
+	/* start with 2nd row and create every other.  The first 2 pixels in each
+	 * row are taken from the source, the next one is interpolated from the
+	 * last and the following one.
+	 */
+	dst = dst_in + w;
+	for (i = 0; i < h; i += 2) {
+		p8 = *src++;
+		*dst++ = p8;
+		*dst++ = p8;
+		px = p8;
+		for (j = 2; j < w; j += 2) {
+			p8 = *src++;
+			px = (px << 8) | p8;
+			*dst++ = itbl[px];
+			*dst++ = p8;
+		}
+		dst += w;
+	}
+
+	/* do the rows: the first is a copy of the 2nd line, the missing ones
+	 * are interpolated using the pixels of the rows above and below.
+	 */
+	memcpy(dst_in, dst_in + w, w);
+	dst = dst_in + (w * 2);
+	for (i = 2; i < h - 1; i += 2) {
+		ipol_line(dst, dst + w, dst - w, itbl, w, ident);
+		dst += w * 2;
+	}
+}
+
+static uint8_t* codec47_block(struct sanctx *ctx, uint8_t *src, uint8_t *dst,
+			      uint8_t *p1, uint8_t *p2, uint16_t w,
+			      uint8_t *coltbl, uint16_t size)
+{
+	uint8_t opc, col[2];
+	uint16_t i, j;
+	int8_t *pglyph;
+
+	opc = *src++;
+	if (opc >= 0xF8) {
+		switch (opc) {
+		case 0xff:
+			if (size == 2) {
+				*(dst + 0 + 0) = *src++; *(dst + 0 + 1) = *src++;
+				*(dst + w + 0) = *src++; *(dst + w + 1) = *src++;
+			} else {
+				size >>= 1;
+				src = codec47_block(ctx, src, dst, p1, p2, w, coltbl, size);
+				src = codec47_block(ctx, src, dst + size, p1 + size, p2 + size, w, coltbl, size);
+				dst += (size * w);
+				p1 += (size * w);
+				p2 += (size * w);
+				src = codec47_block(ctx, src, dst, p1, p2, w, coltbl, size);
+				src = codec47_block(ctx, src, dst + size, p1 + size, p2 + size, w, coltbl, size);
+			}
+			break;
+		case 0xfe:
+			blk_fill(dst, *src++, w, size);
+			break;
+		case 0xfd:
+			opc = *src++;
+			col[0] = *src++;
+			col[1] = *src++;
+			pglyph = (size == 8) ? ctx->c47_glyph8x8[opc] : ctx->c47_glyph4x4[opc];
+			for (i = 0; i < size; i++)
+				for (j = 0; j < size; j++)
+					*(dst + (i * w) + j) = col[!*pglyph++];
+			break;
+		case 0xfc:
+			blk_copy(dst, p1, w, size);
+			break;
+		default:
+			blk_fill(dst, coltbl[opc & 7], w, size);
+		}
+	} else {
+		const int32_t mvoff = c47_mv[opc][0] + (c47_mv[opc][1] * w);
+		blk_copy(dst, p2 + mvoff, w, size);
+	}
+	return src;
+}
+
+/* skip over a block in the bitstream, see codec47_block() */
+static uint8_t *codec47_skip(uint8_t *src, uint16_t size)
+{
+	switch (*src++) {
+	case 0xff:
+		if (size == 2)
+			return src + 4;
+		size >>= 1;
+		src = codec47_skip(src, size);
+		src = codec47_skip(src, size);
+		src = codec47_skip(src, size);
+		return codec47_skip(src, size);
+	case 0xfe: return src + 1;
+	case 0xfd: return src + 3;
+	default:   return src;
+	}
+}
+
+#ifdef SANDEC_STATS
+/* histogram bin of a motion vector */
+static int st_mvbin(int dx, int dy)
+{
+	dx = dx < 0 ? -dx : dx;
+	dy = dy < 0 ? -dy : dy;
+	return _min(_max(dx, dy), SANDEC_MVBINS - 1);
+}
+
+/* histogram bin of a motion vector given as offset into a w wide image */
+static int st_mvbin_ofs(int ofs, uint16_t w)
+{
+	int dy = (ofs + (ofs < 0 ? -(w / 2) : w / 2)) / w;
+
+	return st_mvbin(ofs - dy * w, dy);
+}
+
+/* count the opcodes of a block and its sub-blocks, see codec47_skip() */
+static uint8_t *st_c47_block(struct sanctx *ctx, uint8_t *src, uint16_t size)
+{
+	const int bs = (size == 8) ? SANDEC_BLK8 : (size == 4 ? SANDEC_BLK4 : SANDEC_BLK2);
+	uint8_t opc = *src++;
+	int i;
+
+	ST_COUNT(ctx, c47op[bs][opc], 1);
+	if (opc < 0xf8)
+		ST_COUNT(ctx, c47mv[bs][st_mvbin(c47_mv[opc][0], c47_mv[opc][1])], 1);
+	switch (opc) {
+	case 0xff:
+		if (size == 2)
+			return src + 4;
+		for (i = 0; i < 4; i++)
+			src = st_c47_block(ctx, src, size >> 1);
+		return src;
+	case 0xfe: return src + 1;
+	case 0xfd: return src + 3;
+	default:   return src;
+	}
+}
+
+static void st_c47_ops(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h)
+{
+	unsigned int i, j;
+
+	for (j = 0; j < h; j += 8)
+		for (i = 0; i < w; i += 8)
+			src = st_c47_block(ctx, src, 8);
+}
+#endif
+
+/* decode rows of 8x8 blocks, and note in dm which of them are copied
+ * from the previous frame unchanged.
+ */
+static uint8_t *codec47_rows(struct sanctx *ctx, uint8_t *src, uint8_t *dst,
+			     uint8_t *b1, uint8_t *b2, uint16_t w, uint16_t h,
+			     uint8_t *coltbl, uint8_t *dm)
+{
+	unsigned int i, j;
+
+	for (j = 0; j < h; j += 8) {
+		for (i = 0; i < w; i += 8) {
+			*dm++ = (*src >= 0xf8) || c47_mv[*src][0] || c47_mv[*src][1];
+			src = codec47_block(ctx, src, dst + i, b1 + i, b2 + i, w, coltbl, 8);
+		}
+		dst += (w * 8);
+		b1 += (w * 8);
+		b2 += (w * 8);
+	}
+	return src;
+}
+
+static void codec47_band(struct sanctx *ctx, void *arg)
+{
+	struct sanwork *wk = (struct sanwork *)arg;
+
+	codec47_rows(ctx, wk->src, wk->dst, wk->ref1, wk->ref2, wk->w, wk->h,
+		     wk->tbl, wk->map);
+}
+
+/* Like codec48_comp3(): the blocks only read from the previous 2 frames,
+ * bands of block rows are decoded on the worker pool, and the bitstream
+ * offset of the next band is found by skipping over the blocks of the
+ * current one.
+ */
+static void codec47_comp2(struct sanctx *ctx, uint8_t *src, uint8_t *dst,
+			  uint16_t w, uint16_t h, uint8_t *coltbl)
+{
+	uint8_t *b1 = ctx->rt.buf1, *b2 = ctx->rt.buf2, *dm = ctx->rt.dmap;
+	struct sanwork wk[SANDEC_MAXTHREADS + 1];
+	int i, y, bh, nb, pending = 0;
+	uint32_t ofs;
+
+	/* unchanged blocks are relative to b2, the previous image */
+	ctx->rt.dmapref = (w == ctx->rt.bufw && h == ctx->rt.bufh) ? b2 : NULL;
+
+	nb = pool_bands(ctx);
+	if (nb < 2 || (w & 7) || h < 16) {
+		codec47_rows(ctx, src, dst, b1, b2, w, h, coltbl, dm);
+		return;
+	}
+
+	bh = (((h + 7) >> 3) + nb - 1) / nb * 8;
+	for (i = 0, y = 0; y < h; i++, y += bh) {
+		ofs = y * w;
+		wk[i].src = src;
+		wk[i].dst = dst + ofs;
+		wk[i].ref1 = b1 + ofs;
+		wk[i].ref2 = b2 + ofs;
+		wk[i].tbl = coltbl;
+		wk[i].map = dm + (y >> 3) * (w >> 3);
+		wk[i].w = w;
+		wk[i].h = (h - y) < bh ? (h - y) : bh;
+		pool_run(ctx, codec47_band, &wk[i], &pending);
+		if (y + bh < h) {
+			for (ofs = 0; ofs < (bh >> 3) * (w >> 3); ofs++)
+				src = codec47_skip(src, 8);
+		}
+	}
+	pool_wait(ctx, &pending);
+}
+
+static void codec47_comp5(uint8_t *src, uint8_t *dst, uint32_t left)
+{
+	uint8_t opc, rlen, col, j;
+
+	while (left) {
+		opc = *src++;
+		rlen = (opc >> 1) + 1;
+		if (rlen > left)
+			rlen = left;
+		if (opc & 1) {
+			col = *src++;
+			for (j = 0; j < rlen; j++)
+				*dst++ = col;
+		} else {
+			for (j = 0; j < rlen; j++)
+				*dst++ = *src++;
+		}
+		left -= rlen;
+	}
+}
+
+static void codec47_itable(struct sanctx *ctx, uint8_t *src)
+{
+	uint8_t *itbl, *p1, *p2;
+	int i, j;
+
+	itbl = ctx->rt.c47ipoltbl;
+	for (i = 0; i < 256; i++) {
+		p1 = p2 = itbl + i;
+		for (j = 256 - i; j; j--) {
+			*p1 = *p2 = *src++;
+			p1 += 1;
+			p2 += 256;
+		}
+		itbl += 256;
+	}
+	ctx->rt.have_itable = 1;
+}
+
+static int codec47(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h)
+{
+	uint8_t *insrc = src, *dst, comp, newrot, flag;
+	uint32_t decsize;
+	uint16_t seq;
+	int ret;
+
+	seq =    le16_to_cpu(*(uint16_t *)(src + 0));
+	comp =   src[2];
+	newrot = src[3];
+	flag =   src[4];
+	decsize  = le32_to_cpu(ua32(src + 14));	/* decoded (raw frame) size */
+
+	if (seq == 0) {
+		ctx->rt.lastseq = -1;
+		ctx->rt.lastout = NULL;
+		buf_touch(ctx, ctx->rt.buf1);
+		buf_touch(ctx, ctx->rt.buf2);
+		memset(ctx->rt.buf1, src[12], decsize);
+		memset(ctx->rt.buf2, src[13], decsize);
+	}
+	src += 26;
+	if (flag & 1) {
+		codec47_itable(ctx, src);
+		src += 0x8080;
+	}
+
+	ret = 0;
+	dst = ctx->rt.buf0;
+	buf_touch(ctx, dst);
+	switch (comp) {
+	case 0:	memcpy(dst, src, w * h); break;
+	case 1:	codec47_comp1(src, dst, ctx->rt.c47ipoltbl, w, h); break;
+	case 2:	if (seq == (ctx->rt.lastseq + 1)) {
+			codec47_comp2(ctx, src, dst, w, h, insrc + 8);
+			ST_DO(st_ops_later(ctx, ST_OPS_C47, src, w, h, 0, 0));
+		}
+		break;
+	case 3:	memcpy(ctx->rt.buf0, ctx->rt.buf2, ctx->rt.fbsize); break;
+	case 4:	memcpy(ctx->rt.buf0, ctx->rt.buf1, ctx->rt.fbsize); break;
+	case 5:	codec47_comp5(src, dst, decsize); break;
+	default: break;
+	}
+
+	if (seq == ctx->rt.lastseq + 1)
+		c47_swap_bufs(ctx, newrot);
+
+	ctx->rt.lastseq = seq;
+	if (seq > 1)
+		ctx->rt.can_ipol = 1;
+
+	return ret;
+}
+
+/******************************************************************************/
+
+/* scale 4x4 input block to 8x8 output block */
+static void c48_4to8(uint8_t *dst, uint8_t *src, uint16_t w)
+{
+	uint16_t p;
+	/* dst is always aligned, so we can do at least 16bit stores */
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 8; j += 2) { /* 1px > 2x2 block */
+			p = *src++;
+			p = (p << 8) | p; /* 1x2 line */
+			*((uint16_t *)(dst + w * 0 + j)) = p;  // 0|0
+			*((uint16_t *)(dst + w * 1 + j)) = p;  // 0|1
+		}
+		dst += w * 2;
+	}
+}
+
+/* process an 8x8 block */
+static uint8_t *c48_block(uint8_t *src, uint8_t *dst, uint8_t *db, uint16_t w)
+{
+	uint8_t opc, sb[16];
+	int16_t mvofs;
+	uint32_t ofs;
+	int i, j, k;
+
+	opc = *src++;
+	switch (opc) {
+	case 0xFF:	/* 1x1 -> 8x8 block scale */
+		for (i = 0; i < 16; i++)
+			sb[i] = *src;
+		src++;
+		c48_4to8(dst, sb, w);
+		break;
+	case 0xFE:	/* 1x 8x8 copy from deltabuf, 16bit mv from src */
+		mvofs = (int16_t)le16_to_cpu(ua16(src)); src += 2;
+		blk_copy(dst, db + mvofs, w, 8);
+		break;
+	case 0xFD:	/* 2x2 -> 8x8 block scale */
+		sb[ 5] = *src++;
+		sb[ 7] = *src++;
+		sb[13] = *src++;
+		sb[15] = *src++;
+
+		sb[0] = sb[1] = sb[4] = sb[5];
+		sb[2] = sb[3] = sb[6] = sb[7];
+		sb[8] = sb[9] = sb[12] = sb[13];
+		sb[10] = sb[11] = sb[14] = sb[15];
+		c48_4to8(dst, sb, w);
+		break;
+	case 0xFC:	/* 4x copy 4x4 block, per-block c48_mv, index from source */
+		for (i = 0; i < 8; i += 4) {
+			for (k = 0; k < 8; k += 4) {
+				opc = *src++;
+				mvofs = c37_mv[0][opc * 2] + (c37_mv[0][opc * 2 + 1] * w);
+				ofs = (w * i) + k;
+				blk_copy(dst + ofs, db + ofs + mvofs, w, 4);
+			}
+		}
+		break;
+	case 0xFB: 	/* Copy 4x 4x4 blocks, per-block mv from source */
+		for (i = 0; i < 8; i += 4) {			/* 2 */
+			for (k = 0; k < 8; k += 4) {		/* 2 */
+				mvofs = le16_to_cpu(ua16(src)); src += 2;
+				ofs = (w * i) + k;
+				blk_copy(dst + ofs, db + ofs + mvofs, w, 4);
+			}
+		}
+		break;
+	case 0xFA:	/* scale 4x4 input block to 8x8 dest block */
+		c48_4to8(dst, src, w);
+		src += 16;
+		break;
+	case 0xF9:	/* 16x 2x2 copy from delta, per-block c48_mv */
+		for (i = 0; i < 8; i += 2) {				/* 4 */
+			for (j = 0; j < 8; j += 2) {			/* 4 */
+				ofs = (w * i) + j;
+				opc = *src++;
+				mvofs = c37_mv[0][opc * 2] + (c37_mv[0][opc * 2 + 1] * w);
+				blk_copy(dst + ofs, db + ofs + mvofs, w, 2);
+			}
+		}
+		break;
+	case 0xF8:	/* 16x 2x2 blocks copy, mv from source */
+		for (i = 0; i < 8; i += 2) {				/* 4 */
+			for (j = 0; j < 8; j += 2) {			/* 4 */
+				ofs = w * i + j;
+				mvofs = le16_to_cpu(ua16(src)); src += 2;
+				blk_copy(dst + ofs, db + ofs + mvofs, w, 2);
+			}
+		}
+		break;
+	case 0xF7:	/* copy 8x8 block from src to dest */
+		blk_put(dst, src, w, 8);
+		src += 64;
+		break;
+	default:	/* copy 8x8 block from prev, c48_mv */
+		mvofs = c37_mv[0][opc * 2] + (c37_mv[0][opc * 2 + 1] * w);
+		blk_copy(dst, db + mvofs, w, 8);
+		break;
+	}
+	return src;
+}
+
+/* size of an 8x8 block in the bitstream, including the opcode */
+static inline int c48_blksz(uint8_t opc)
+{
+	switch (opc) {
+	case 0xFF: return 2;
+	case 0xFE: return 3;
+	case 0xFD: return 5;
+	case 0xFC: return 5;
+	case 0xFB: return 9;
+	case 0xFA: return 17;
+	case 0xF9: return 17;
+	case 0xF8: return 33;
+	case 0xF7: return 65;
+	default:   return 1;
+	}
+}
+
+/* decode rows of 8x8 blocks, and note in dm which of them are copied
+ * from the previous frame unchanged.
+ */
+static uint8_t *codec48_rows(uint8_t *src, uint8_t *dst, uint8_t *db,
+			     uint16_t w, uint16_t h, uint8_t *dm)
+{
+	int i, j;
+
+	for (i = 0; i < h; i += 8) {
+		for (j = 0; j < w; j += 8) {
+			if (*src == 0xFE)
+				*dm++ = !!ua16(src + 1);
+			else
+				*dm++ = (*src >= 0xF7) || c37_mv[0][*src * 2]
+					|| c37_mv[0][*src * 2 + 1];
+			src = c48_block(src, dst + j, db + j, w);
+		}
+		dst += w * 8;
+		db += w * 8;
+	}
+	return src;
+}
+
+#ifdef SANDEC_STATS
+/* count the motion vectors of a block, see c48_block() */
+static void st_c48_mv(struct sanctx *ctx, uint8_t *src, uint16_t w)
+{
+	uint8_t opc = *src++;
+	int i;
+
+	switch (opc) {
+	case 0xFE:
+		ST_COUNT(ctx, c48mv[SANDEC_BLK8][st_mvbin_ofs((int16_t)le16_to_cpu(ua16(src)), w)], 1);
+		break;
+	case 0xFC:
+	case 0xF9:
+		for (i = 0; i < (opc == 0xFC ? 4 : 16); i++, src++)
+			ST_COUNT(ctx, c48mv[opc == 0xFC ? SANDEC_BLK4 : SANDEC_BLK2]
+				 [st_mvbin(c37_mv[0][*src * 2], c37_mv[0][*src * 2 + 1])], 1);
+		break;
+	case 0xFB:
+	case 0xF8:
+		for (i = 0; i < (opc == 0xFB ? 4 : 16); i++, src += 2)
+			ST_COUNT(ctx, c48mv[opc == 0xFB ? SANDEC_BLK4 : SANDEC_BLK2]
+				 [st_mvbin_ofs((int16_t)le16_to_cpu(ua16(src)), w)], 1);
+		break;
+	case 0xFF:
+	case 0xFD:
+	case 0xFA:
+	case 0xF7:
+		break;
+	default:
+		ST_COUNT(ctx, c48mv[SANDEC_BLK8][st_mvbin(c37_mv[0][opc * 2], c37_mv[0][opc * 2 + 1])], 1);
+	}
+}
+
+static void st_c48_ops(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h)
+{
+	int i, j;
+
+	for (i = 0; i < h; i += 8) {
+		for (j = 0; j < w; j += 8) {
+			ST_COUNT(ctx, c48op[*src], 1);
+			st_c48_mv(ctx, src, w);
+			src += c48_blksz(*src);
+		}
+	}
+}
+#endif
+
+static void codec48_band(struct sanctx *ctx, void *arg)
+{
+	struct sanwork *wk = (struct sanwork *)arg;
+
+	codec48_rows(wk->src, wk->dst, wk->ref1, wk->w, wk->h, wk->map);
+}
+
+/* The blocks only read from the previous frame, so with the bitstream
+ * offset of each block row known, bands of block rows can be decoded
+ * independently.  The offset of the next band is found by summing up the
+ * block sizes while the workers are already busy with the previous ones.
+ */
+static void codec48_comp3(struct sanctx *ctx, uint8_t *src, uint8_t *dst,
+			  uint8_t *db, uint8_t *itbl, uint16_t w, uint16_t h)
+{
+	struct sanwork wk[SANDEC_MAXTHREADS + 1];
+	int i, y, bh, nb, pending = 0;
+	uint8_t *dm = ctx->rt.dmap;
+	uint32_t ofs;
+
+	/* unchanged blocks are relative to db, the previous image */
+	ctx->rt.dmapref = (w == ctx->rt.bufw && h == ctx->rt.bufh) ? db : NULL;
+
+	/* partial blocks at the right edge spill into the next line */
+	nb = pool_bands(ctx);
+	if (nb < 2 || (w & 7) || h < 16) {
+		codec48_rows(src, dst, db, w, h, dm);
+		return;
+	}
+
+	bh = (((h + 7) >> 3) + nb - 1) / nb * 8;
+	for (i = 0, y = 0; y < h; i++, y += bh) {
+		ofs = y * w;
+		wk[i].src = src;
+		wk[i].dst = dst + ofs;
+		wk[i].ref1 = db + ofs;
+		wk[i].map = dm + (y >> 3) * (w >> 3);
+		wk[i].w = w;
+		wk[i].h = (h - y) < bh ? (h - y) : bh;
+		pool_run(ctx, codec48_band, &wk[i], &pending);
+		if (y + bh < h) {
+			for (ofs = 0; ofs < (bh >> 3) * (w >> 3); ofs++)
+				src += c48_blksz(*src);
+		}
+	}
+	pool_wait(ctx, &pending);
+}
+
+static int codec48(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h)
+{
+	uint8_t comp, flag, *dst;
+	uint32_t pktsize, decsize;
+	uint16_t seq;
+	int ret;
+
+	comp =	src[0];		/* subcodec */
+	if (src[1] != 1)	/* mvec table variant, always 1 with MotS */
+		return 26;
+
+	seq = le16_to_cpu(*(uint16_t*)(src + 2));
+
+	/* decsize is the size of the raw frame aligned to 8x8 blocks
+	 * when seq == 0, otherwise it's identical to pktsize, which
+	 * indicates the number of bytes in the datastream for this packet.
+	 */
+	decsize = le32_to_cpu(ua32(src + 4));
+	pktsize = le32_to_cpu(ua32(src + 8));
+	flag =	src[12];
+
+	if (seq == 0) {
+		ctx->rt.lastseq = -1;
+		ctx->rt.lastout = NULL;
+		buf_touch(ctx, ctx->rt.buf0);
+		buf_touch(ctx, ctx->rt.buf2);
+		memset(ctx->rt.buf0, 0, decsize);
+		memset(ctx->rt.buf2, 0, decsize);
+	}
+
+	src += 16;
+	if (flag & 8) {
+		codec47_itable(ctx, src);
+		src += 0x8080;
+	}
+
+	ret = 0;
+	dst = ctx->rt.buf0;
+	buf_touch(ctx, dst);
+	switch (comp) {
+	case 0:	memcpy(dst, src, pktsize); break;
+	case 2: codec47_comp5(src, dst, decsize); break;
+	case 3: codec48_comp3(ctx, src, dst, ctx->rt.buf2, ctx->rt.c47ipoltbl, w, h);
+		ST_DO(st_ops_later(ctx, ST_OPS_C48, src, w, h, 0, 0));
+		break;
+	case 5: codec47_comp1(src, dst, ctx->rt.c47ipoltbl, w, h); break;
+	default: break;
+	}
+
+	if (seq > 1)
+		ctx->rt.can_ipol = 1;
+	ctx->rt.lastseq = seq;
+	c47_swap_bufs(ctx, 1);	/* swap 0 and 2 */
+
+	return ret;
+}
+
+/******************************************************************************/
+
+static void codec37_comp1(uint8_t *src, uint8_t *dst, uint8_t *db, uint16_t w,
+			  uint16_t h, uint8_t mvidx, uint8_t *dm)
+{
+	uint8_t opc, run, skip;
+	int32_t mvofs, ofs;
+	int i, j, k, l, len;
+
+	run = 0;
+	len = -1;
+	opc = 0;
+	for (i = 0; i < h; i += 4) {
+		for (j = 0; j < w; j += 4) {
+			if (len < 0) {
+				len = (*src) >> 1;
+				run = !!((*src++) & 1);
+				skip = 0;
+			} else {
+				skip = run;
+			}
+
+			if (!skip) {
+				opc = *src++;
+				if (opc == 0xff) {
+					if (dm)
+						dm[j >> 2] = 1;
+					len--;
 					for (k = 0; k < 4; k++) {
 						ofs = j + (k * w);
 						for (l = 0; l < 4; l++) {
@@ -975,693 +2528,2889 @@ static void codec37_comp1(uint8_t *src, uint8_t *dst, uint8_t *db, uint16_t w,
 					continue;
 				}
 			}
-			/* 4x4 block copy from prev with MV */
-			mvofs = c37_mv[mvidx][opc*2] + (c37_mv[mvidx][opc*2 + 1] * w);
-			for (k = 0; k < 4; k++) {
-				ofs = j + (k * w);
-				for (l = 0; l < 4; l++)
-					*(dst + ofs + l) = *(db + ofs + l + mvofs);
-			}
-			len -= 1;
+			/* 4x4 block copy from prev with MV */
+			mvofs = c37_mv[mvidx][opc*2] + (c37_mv[mvidx][opc*2 + 1] * w);
+			blk_copy(dst + j, db + j + mvofs, w, 4);
+			if (dm)
+				dm[j >> 2] = (mvofs != 0);
+			len -= 1;
+		}
+		dst += w * 4;
+		db += w * 4;
+		if (dm)
+			dm += (w + 3) >> 2;
+	}
+}
+
+static void codec37_comp3(uint8_t *src, uint8_t *dst, uint8_t *db, uint16_t w, uint16_t h,
+			  uint8_t mvidx, const uint8_t f4, const uint8_t c4,
+			  uint8_t *dm)
+{
+	uint8_t opc, c, copycnt;
+	int32_t ofs, mvofs;
+	int i, j, k, l;
+
+	copycnt = 0;
+	for (i = 0; i < h; i += 4) {
+		for (j = 0; j < w; j += 4) {
+
+			/* copy a 4x4 block from the previous frame from same spot */
+			if (copycnt > 0) {
+c37_blk:
+				blk_copy(dst + j, db + j, w, 4);
+				if (dm)
+					dm[j >> 2] = 0;
+				copycnt--;
+				continue;
+			}
+
+			opc = *src++;
+			if (dm)
+				dm[j >> 2] = 1;
+			if (opc == 0xff) {
+				/* 4x4 block, per-pixel data from source */
+				blk_put(dst + j, src, w, 4);
+				src += 16;
+			} else if (f4 && (opc == 0xfe)) {
+				/* 4x4 block, per-line color from source */
+				for (k = 0; k < 4; k++) {
+					c = *src++;
+					ofs = j + (k * w);
+					for (l = 0; l < 4; l++)
+						*(dst + ofs + l) = c;
+				}
+			} else if (f4 && (opc == 0xfd)) {
+				/* 4x4 block, per block color from source */
+				blk_fill(dst + j, *src++, w, 4);
+			} else if (c4 && (opc == 0)) {
+				/* copy 4x4 block from prev frame, cnt from src */
+				copycnt = 1 + *src++;
+				goto c37_blk; /* curr. block needs to be handled too */
+			} else {
+				/* 4x4 block copy from prev with MV */
+				mvofs = c37_mv[mvidx][opc*2] + (c37_mv[mvidx][opc*2 + 1] * w);
+				blk_copy(dst + j, db + j + mvofs, w, 4);
+				if (dm)
+					dm[j >> 2] = (mvofs != 0);
+			}
+		}
+		dst += w * 4;
+		db += w * 4;
+		if (dm)
+			dm += (w + 3) >> 2;
+	}
+}
+
+#ifdef SANDEC_STATS
+/* count the opcodes read by codec37_comp1() */
+static void st_c37_comp1(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h)
+{
+	uint8_t opc, run = 0;
+	int i, j, k, len = -1;
+
+	for (i = 0; i < h; i += 4) {
+		for (j = 0; j < w; j += 4) {
+			if (len < 0) {
+				len = (*src) >> 1;
+				run = !!((*src++) & 1);
+			} else if (run) {
+				len--;
+				continue;
+			}
+			opc = *src++;
+			ST_COUNT(ctx, c37op[opc], 1);
+			len--;
+			if (opc != 0xff)
+				continue;
+			for (k = 0; k < 16; k++) {
+				if (len < 0) {
+					len = (*src) >> 1;
+					run = !!((*src++) & 1);
+					if (run)
+						src++;
+				}
+				if (!run)
+					src++;
+				len--;
+			}
+		}
+	}
+}
+
+/* count the opcodes read by codec37_comp3() */
+static void st_c37_comp3(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h,
+			 const uint8_t f4, const uint8_t c4)
+{
+	uint8_t opc, copycnt = 0;
+	int i, j;
+
+	for (i = 0; i < h; i += 4) {
+		for (j = 0; j < w; j += 4) {
+			if (copycnt > 0) {
+				copycnt--;
+				continue;
+			}
+			opc = *src++;
+			ST_COUNT(ctx, c37op[opc], 1);
+			if (opc == 0xff)
+				src += 16;
+			else if (f4 && (opc == 0xfe))
+				src += 4;
+			else if (f4 && (opc == 0xfd))
+				src += 1;
+			else if (c4 && (opc == 0))
+				copycnt = *src++;
+		}
+	}
+}
+
+/* count the opcodes of the codec call just timed */
+static void st_ops(struct sanctx *ctx)
+{
+	struct sanstops *so = &ctx->stops;
+
+	switch (so->op) {
+	case ST_OPS_C47:   st_c47_ops(ctx, so->src, so->w, so->h); break;
+	case ST_OPS_C48:   st_c48_ops(ctx, so->src, so->w, so->h); break;
+	case ST_OPS_C37C1: st_c37_comp1(ctx, so->src, so->w, so->h); break;
+	case ST_OPS_C37C3: st_c37_comp3(ctx, so->src, so->w, so->h, so->f4, so->c4); break;
+	default: break;
+	}
+	so->op = 0;
+}
+#endif
+
+static int codec37(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h,
+		   uint16_t top, uint16_t left)
+{
+	uint8_t comp, mvidx, flag, *dst, *db, *dm = NULL;
+	struct sanrt *rt = &ctx->rt;
+	uint32_t decsize;
+	uint16_t seq;
+	int ret;
+
+	comp = src[0];
+	mvidx = src[1];
+	if (mvidx > 2)
+		return 18;
+	seq = le16_to_cpu(*(uint16_t *)(src + 2));
+	decsize = le32_to_cpu(ua32(src + 4));
+	flag = src[12];
+
+	if (comp == 0 || comp == 2) {
+		buf_touch(ctx, ctx->rt.buf2);
+		memset(ctx->rt.buf2, 0, decsize);
+	}
+
+	/* Codec37's  buffers are private, no other codec must touch them.
+	 * Therefore we operate on buf1/buf2 rather than buf0/buf2, since
+	 * buf0 is also touched by default by other codecs, and this results
+	 * in unexpected image issues.
+	 * Unlike c47, buffers need to be pre-rotated.
+	 */
+	if ((comp == 1 || comp == 3 || comp == 4)
+	    && ((seq & 1) || !(flag & 1))) {
+		void *tmp = ctx->rt.buf1;
+		ctx->rt.buf1 = ctx->rt.buf2;
+		ctx->rt.buf2 = tmp;
+	}
+
+	src += 16;
+	ret = 0;
+	dst = ctx->rt.buf1 + (top * w) + left;
+	db = ctx->rt.buf2 + (top * w) + left;
+	buf_touch(ctx, ctx->rt.buf1);
+
+	/* the changes are known if db has the last image */
+	if ((comp == 1 || comp == 3 || comp == 4) && (db == rt->c37ref)
+	    && !top && !left && (w == rt->bufw) && (h == rt->bufh)) {
+		cmap_use(rt, db);
+		if (!rt->cmap_all)
+			dm = rt->cmap;
+	} else {
+		rt->cmap_all = 1;
+	}
+
+	switch (comp) {
+	case 0: memcpy(dst, src, decsize); break;
+	case 1: codec37_comp1(src, dst, db, w, h, mvidx, dm);
+		ST_DO(st_ops_later(ctx, ST_OPS_C37C1, src, w, h, 0, 0));
+		break;
+	case 2: codec47_comp5(src, dst, decsize); break;
+	case 3: /* fallthrough */
+	case 4: codec37_comp3(src, dst, db, w, h, mvidx, flag & 4, comp == 4, dm);
+		ST_DO(st_ops_later(ctx, ST_OPS_C37C3, src, w, h, flag & 4, comp == 4));
+		break;
+	default: break;
+	}
+
+	/* the final image is also buf0's, in case another codec needs to
+	 * operate on it.  It's copied there only when that happens.
+	 */
+	rt->b0src = rt->buf1;
+	rt->vbuf = rt->buf1;
+	ctx->rt.lastseq = seq;
+	rt->c37ref = rt->buf1;
+
+	return ret;
+}
+
+/******************************************************************************/
+
+static void codec1(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h,
+		   int16_t top, int16_t left)
+{
+	uint8_t *dst, code, col;
+	uint16_t rlen, dlen;
+	int i, j;
+
+	for (i = 0; i < h; i++) {
+		dst = ctx->rt.buf0 + ((top + i) * ctx->rt.pitch) + left;
+		dlen = le16_to_cpu(ua16(src)); src += 2;
+		while (dlen > 0) {
+			code = *src++; dlen--;
+			rlen = (code >> 1) + 1;
+			if (code & 1) {
+				col = *src++; dlen--;
+				if (col)
+					for (j = 0; j < rlen; j++)
+						*(dst + j) = col;
+				dst += rlen;
+			} else {
+				for (j = 0; j < rlen; j++) {
+					col = *src++;
+					if (col)
+						*dst = col;
+					dst++;
+				}
+				dlen -= rlen;
+			}
+		}
+	}
+}
+
+/******************************************************************************/
+
+static int fobj_alloc_buffers(struct sanctx *ctx, uint16_t w, uint16_t h, uint8_t bpp, unsigned align)
+{
+	struct sanrt *rt = &ctx->rt;
+	uint16_t wb, hb;
+	uint32_t bs, fbs, os, ps;
+	uint8_t *b, obpp;
+
+	if (align > 1) {
+		/* align sizes */
+		align -= 1;
+		wb = (w + align) & ~align;
+		hb = (h + align) & ~align;
+	} else {
+		wb = w;
+		hb = h;
+	}
+
+	/* don't support strides different from image width (yet) */
+	if (wb != w) {
+		return 50;
+	}
+
+	/* we require up to 3 buffers the size of the image.
+	 * a front buffer + 2 work buffers,  a buffer used to store
+	 * the frontbuffer on "STOR" and an 2 intermediate buffers for
+	 * interpolated frames (c47/c48 videos only).
+	 *
+	 * Then we need a "guard band" before and after the buffers for motion
+	 * vectors that point outside the defined video area, esp. for codec37
+	 * and codec48.  32 lines (max of mvec tables) is enough to get rid of
+	 * all tiny artifacts.
+	 *
+	 * The image in the output format and the frame pool for
+	 * sandec_frame_hold() come last.
+	 */
+	bs = wb * hb * bpp;		/* block-aligned 8 bit sizes */
+	bs = (bs + 0xfff) & ~0xfff;	/* align to 4K */
+	fbs = bs * 6 + (wb * 32 * 4);	/* 4 buffers, 4 guard "bands" */
+	fbs += ((wb + 7) >> 3) * ((hb + 7) >> 3);	/* 8x8 block map */
+	fbs += ((wb + 3) >> 2) * ((hb + 3) >> 2);	/* 4x4 change map */
+	fbs = (fbs + 15) & ~15;
+	obpp = fmt_bpp(ctx->ofmt);
+	os = fmt_size(ctx->ofmt, w, h);
+	if (ctx->obufu && ctx->obufusz < os)
+		return 74;
+	ps = (os ? os : w * h * bpp) * ctx->nframes;
+	if (ctx->obufu)
+		os = 0;
+	b = (uint8_t *)malloc(fbs + os + ps);
+	if (!b)
+		return 51;
+	memset(b, 0, fbs + os + ps);	/* clear everything including the guard bands */
+	ST_COUNT(ctx, falloc, 1);
+
+	if (rt->buf)
+		frames_drop_arena(ctx, rt->buf);
+
+	rt->buf = b;
+	rt->bufsize = fbs;
+	rt->obuf = b + fbs;
+	rt->olast = NULL;
+	rt->obpp = obpp;
+	rt->osize = fmt_size(ctx->ofmt, w, h);
+	rt->fpool = rt->obuf + os;
+	rt->nfpool = ctx->nframes;
+	rt->buf0 = b + (wb * 32);	/* leave a guard band for motion vectors */
+	rt->buf1 = rt->buf0 + (wb * 32) + bs;
+	rt->buf2 = rt->buf1 + (wb * 32) + bs;
+	rt->buf3 = rt->buf2 + (wb * 32) + bs;
+	rt->buf4 = rt->buf3 + bs;
+	rt->buf5 = rt->buf4 + bs;
+	buf_reset(rt);
+	rt->dmap = rt->buf5 + bs;
+	rt->cmap = rt->dmap + ((wb + 7) >> 3) * ((hb + 7) >> 3);
+	rt->dmapref = NULL;
+	rt->lastout = NULL;
+	rt->c37ref = NULL;
+	rt->fbsize = w * h * bpp;	/* image size reported to caller */
+	rt->bufw = w;			/* buffer (aligned) width */
+	rt->bufh = h;
+
+	return 0;
+}
+
+static int handle_FOBJ(struct sanctx *ctx, uint32_t size, uint8_t *src)
+{
+	struct sanrt *rt = &ctx->rt;
+	uint16_t w, h, wr, hr, align, param2;
+	uint8_t codec, param;
+	int16_t left, top;
+	int ret;
+
+	codec = src[0];
+	param = src[1];
+	ST_COUNT(ctx, codec[codec], 1);
+
+	left   = le16_to_cpu(*(int16_t *)(src + 2));
+	top    = le16_to_cpu(*(int16_t *)(src + 4));
+	w = wr = le16_to_cpu(*(uint16_t *)(src + 6));
+	h = hr = le16_to_cpu(*(uint16_t *)(src + 8));
+	param2 = le16_to_cpu(*(uint16_t *)(src + 12));
+
+	align = (codec == 37) ? 4 : 2;
+	align = (codec == 48) ? 8 : align;
+
+	/* ignore too small dimensions in first frames, happens with some
+	 * Full Throttle videos
+	 */
+	if (!rt->fbsize && (w < align || h < align))
+		return 0;
+
+	/* there are some odd-sized frames in RA1, but all seem to work on
+	 * a 320x200 buffer.  Pass 320x200 to the buffer allocator.
+	 * Need also to set a separate pitch since most of the codec1-33 videos
+	 * work on parts of the image and have their dimensions and origin set
+	 * to that part.
+	 */
+	if (rt->version < 2 && (w < 320 || h < 200) && (top == 0) && left == 0) {
+		wr = 320;
+		hr = 200;
+		rt->pitch = 320;
+	}
+
+	/* disable left/top for codec47/48 videos.  Except for SotE, none use
+	 * it, and SotE uses it as a hack to get "widescreen" aspect, i.e. it's
+	 * just a black bar of 60 pixels heigth at the top.
+	 */
+	if (codec == 47 || codec == 48) {
+		rt->pitch = w;
+		left = top = 0;
+	}
+
+	if (rt->pitch == 0 && w >= 300)
+		rt->pitch = w;
+
+	ret = 0;
+	if ((rt->bufw < (left + wr)) || (rt->bufh < (top + hr))) {
+		ret = fobj_alloc_buffers(ctx, _max(rt->bufw, left + wr),
+					 _max(rt->bufh, top + hr), 1, align);
+	}
+	if (ret != 0)
+		return ret;
+
+	/* default image buffer is buf0; only c47/c48 maintain the block map */
+	if (codec != 37)
+		buf0_sync(ctx);
+	rt->vbuf = rt->buf0;
+	rt->dmapref = NULL;
+
+	switch (codec) {
+	case 1:
+	case 3: ST_TIME(ctx, SANDEC_ST_CODEC1,
+			codec1(ctx, src + 14, w, h, top, left)); break;
+	case 37:ST_TIME(ctx, SANDEC_ST_CODEC37,
+			ret = codec37(ctx, src + 14, w, h, top, left)); break;
+	case 47:ST_TIME(ctx, SANDEC_ST_CODEC47,
+			ret = codec47(ctx, src + 14, w, h)); break;
+	case 48:ST_TIME(ctx, SANDEC_ST_CODEC48,
+			ret = codec48(ctx, src + 14, w, h)); break;
+	default: ret = 10;
+	}
+	/* outside of the codec times */
+	ST_DO(st_ops(ctx));
+
+	/* track the changes to the image */
+	if (codec == 1 || codec == 3) {
+		cmap_use(rt, rt->buf0);
+		if (rt->pitch == rt->bufw)
+			cmap_rect(rt, left, top, w, h);
+		else
+			rt->cmap_all = 1;
+	} else if (codec == 47 || codec == 48) {
+		if (rt->dmapref) {
+			cmap_use(rt, rt->dmapref);
+			if (!rt->cmap_all)
+				cmap_from_dmap(rt);
+		} else {
+			rt->cmap_all = 1;
+		}
+	}
+	if (codec != 37)
+		rt->c37ref = NULL;
+
+	if (ret == 0) {
+		ctx->rt.have_frame = 1;
+
+		/* trust the dimensions in the v2 videos; for older assume 320x200 as
+		 * the final dimensions.
+		 * FIXME: May need to be revisited for RA/RA2.
+		 */
+		if (rt->version > 1) {
+			rt->frmw = _max(rt->frmw, w);
+			rt->frmh = _max(rt->frmh, h);
+		} else {
+			rt->frmw = 320;
+			rt->frmh = 200;
+
+			/* that few stupid Full Throttle videos which are slightly
+			 * larger but still have the 320x200 visible area.
+			 * Concatenate the visible image area to 320x200 in the
+			 * STOR buffer.
+			 */
+			if (w > 320 && w < 400 && h > 200 && h < 250) {
+				int i, j;
+				buf_touch(ctx, rt->buf3);
+				for (i = 0; i < 200; i++)
+					for (j = 0; j < 320; j++)
+						*(rt->buf3 + (i * 320) + j) = *(rt->vbuf + (i * w) + j);
+				rt->vbuf = rt->buf3;
+				rt->cmap_all = 1;
+			}
+		}
+	}
+
+	return ret;
+}
+
+static void handle_NPAL(struct sanctx *ctx, uint32_t size, uint8_t *src)
+{
+	read_palette(ctx, src);
+}
+
+static int handle_XPAL(struct sanctx *ctx, uint32_t size, uint8_t *src)
+{
+	const uint16_t cmd = be16_to_cpu(*(uint16_t *)(src + 2));
+	uint32_t *pal = ctx->rt.palette;
+	int16_t *dp = ctx->rt.deltapal;
+	int16_t c[768];
+	uint32_t np, diff;
+	int i, v;
+
+	src += 4;
+
+	/* cmd1: apply delta.  All 768 components in one flat loop, which the
+	 * compiler can vectorize.  c / 128 and c >> 7 only differ for
+	 * negative c, which ends up as 0 either way.
+	 */
+	if (cmd == 1) {
+		for (i = 0; i < 256; i++) {
+			c[i * 3 + 0] = (pal[i] >>  0) & 0xff;
+			c[i * 3 + 1] = (pal[i] >>  8) & 0xff;
+			c[i * 3 + 2] = (pal[i] >> 16) & 0xff;
+		}
+		for (i = 0; i < 768; i++) {
+			v = (c[i] * 129 + (int16_t)le16_to_cpu(dp[i])) >> 7;
+			c[i] = v < 0 ? 0 : (v > 255 ? 255 : v);
+		}
+		diff = 0;
+		for (i = 0; i < 256; i++) {
+			np = 0xffU << 24 | c[i * 3 + 2] << 16 | c[i * 3 + 1] << 8 | c[i * 3];
+			diff |= np ^ pal[i];
+			pal[i] = np;
+		}
+		/* a fade which already reached its end changes nothing */
+		if (diff) {
+			ctx->rt.cmap_all = 1;
+			ctx->palgen++;
+		}
+	/* cmd0/2: read deltapal values/+new palette */
+	} else if (cmd == 0 || cmd == 2) {
+		memcpy(ctx->rt.deltapal, src, 768 * 2);
+		if (size > (768 * 2 + 4))	/* cmd 2 */
+			read_palette(ctx, src + (768 * 2));
+	} else {
+		return 13;		/*  unknown XPAL cmd */
+	}
+	return 0;
+}
+
+/* hand decoded audio to the caller, or collect it while the audio is
+ * decoded on a worker thread.
+ */
+static void audio_out(struct sanctx *ctx, uint8_t *buf, uint32_t size)
+{
+	struct sanrt *rt = &ctx->rt;
+	uint8_t *aq;
+	uint32_t sz;
+
+	if (!rt->aqdefer) {
+		ctx->io->queue_audio(ctx->io->userctx, buf, size);
+		return;
+	}
+
+	if (rt->aqlen + size > rt->aqsize) {
+		sz = _max(rt->aqlen + size, rt->aqsize + SZ_AQ);
+		aq = (uint8_t *)realloc(rt->aq, sz);
+		if (!aq)
+			return;		/* drop it */
+		rt->aq = aq;
+		rt->aqsize = sz;
+	}
+	memcpy(rt->aq + rt->aqlen, buf, size);
+	rt->aqlen += size;
+}
+
+static void iact_audio_scaled(struct sanctx *ctx, uint32_t size, uint8_t *src)
+{
+	uint8_t v1, v2, v3, *src2, *ib = ctx->rt.iactbuf;
+	uint16_t count, len;
+	int16_t *dst;
+
+	/* algorithm taken from ScummVM/engines/scumm/smush/smush_player.cpp */
+	while (size > 0) {
+		if (ctx->rt.iactpos >= 2) {
+			len = be16_to_cpu(*(uint16_t *)ib) + 2 - ctx->rt.iactpos;
+			if (len > size) {  /* continued in next IACT chunk. */
+				memcpy(ib + ctx->rt.iactpos, src, size);
+				ctx->rt.iactpos += size;
+				size = 0;
+			} else {
+				memcpy(ib + ctx->rt.iactpos, src, len);
+				size -= len;
+				src += len;
+				ctx->rt.iactpos = 0;
+				/* drop the packet partially seen after a seek,
+				 * and all of them while catching up to the target.
+				 */
+				if (ctx->rt.iactdrop || ctx->rt.quiet) {
+					ctx->rt.iactdrop = 0;
+					continue;
+				}
+				dst = (int16_t *)ctx->rt.abuf;
+				src2 = ib + 2;
+				v1 = *src2++;
+				v2 = v1 >> 4;
+				v1 &= 0x0f;
+				count = 1024 * 2;
+				do {
+					v3 = *src2++;
+					if (v3 == 0x80) {
+						*dst++ = cpu_to_le16(src2[0] << 8 | src2[1]);
+						src2 += 2;
+					} else {
+						*dst++ = cpu_to_le16((int8_t)v3) << ((count & 1) ? v1 : v2);
+					}
+				} while (--count);
+				audio_out(ctx, ctx->rt.abuf, SZ_AUDIOOUT);
+			}
+		} else {
+			if (size > 1 && ctx->rt.iactpos == 0) {
+				*ib = *src++;
+				ctx->rt.iactpos++;
+				size--;
+			}
+			*(ib + ctx->rt.iactpos) = *src++;
+			ctx->rt.iactpos++;
+			size--;
+		}
+	}
+}
+
+/******************************************************************************/
+/* PSAD/SAUD and iMUSE IACT audio: each track is decoded to 16bit stereo at
+ * the mixer rate into its own ring, with its volume and panning applied.
+ * At the end of each FRME, all tracks are mixed into fixed-size blocks up
+ * to the end time of the frame, and handed out through audio_out().
+ * Algorithms and formats taken from ScummVM/engines/scumm/smush/.
+ */
+
+/* add n stereo frames of a track to the accumulator */
+static void mix_add(int32_t *restrict acc, const int16_t *restrict src,
+		    uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n * 2; i++)
+		acc[i] += src[i];
+}
+
+/* saturate the accumulator to 16 bits */
+static void mix_clip(int16_t *restrict dst, const int32_t *restrict acc,
+		     uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n * 2; i++)
+		dst[i] = cpu_to_le16(_min(_max(acc[i], -32768), 32767));
+}
+
+/* start time of frame f in stereo frames at the mixer rate */
+static uint64_t mix_time(struct sanrt *rt, uint32_t f)
+{
+	return (uint64_t)f * rt->framedur * MIX_RATE / 1000000;
+}
+
+/* drop all tracks, and restart mixing at the current frame */
+static void mix_reset(struct sanrt *rt)
+{
+	int i;
+
+	if (!rt->mix)
+		return;
+	for (i = 0; i < SANDEC_MAXACHAN; i++) {
+		rt->mix->ch[i].state = ACH_FREE;
+		rt->mix->ch[i].rd = rt->mix->ch[i].wr = 0;
+	}
+	rt->mix->pos = mix_time(rt, rt->currframe);
+}
+
+static void mix_free(struct sanrt *rt)
+{
+	int i;
+
+	if (!rt->mix)
+		return;
+	for (i = 0; i < SANDEC_MAXACHAN; i++)
+		free(rt->mix->ch[i].ring);
+	free(rt->mix);
+	rt->mix = NULL;
+}
+
+/* mix and hand out all blocks which end before the end of the current
+ * frame.  Once a file has used the mixer, this goes on with silence when
+ * no track is playing, so the audio keeps pace with the video.
+ */
+static void mix_frame(struct sanctx *ctx)
+{
+	struct sanrt *rt = &ctx->rt;
+	struct sanmix *mx = rt->mix;
+	struct sanachan *ch;
+	uint32_t n, a, seg;
+	uint64_t end;
+	int i;
+
+	if (!mx)
+		return;
+	end = mix_time(rt, rt->currframe + 1);
+	while (mx->pos + SZ_MIXBLK <= end) {
+		memset(mx->acc, 0, sizeof(mx->acc));
+		for (i = 0, ch = mx->ch; i < SANDEC_MAXACHAN; i++, ch++) {
+			if (ch->state == ACH_FREE)
+				continue;
+			n = _min(ch->wr - ch->rd, SZ_MIXBLK);
+			a = ch->rd & (ch->ringsz - 1);
+			seg = _min(n, ch->ringsz - a);
+			/* while catching up to a seek target, only drain */
+			if (!rt->quiet) {
+				mix_add(mx->acc, ch->ring + a * 2, seg);
+				mix_add(mx->acc + seg * 2, ch->ring, n - seg);
+			}
+			ch->rd += n;
+			/* a finished track is gone once all of it is played */
+			if (ch->last && ch->rd == ch->wr)
+				ch->state = ACH_FREE;
+		}
+		if (!rt->quiet) {
+			mix_clip((int16_t *)rt->abuf, mx->acc, SZ_MIXBLK);
+			audio_out(ctx, rt->abuf, SZ_MIXBLK * 4);
+		}
+		mx->pos += SZ_MIXBLK;
+	}
+}
+
+/* append a stereo frame at the mixer rate; the ring grows when full */
+static void achan_put(struct sanachan *ch, int16_t l, int16_t r)
+{
+	uint32_t a, n;
+	int16_t *b;
+
+	if (ch->wr - ch->rd >= ch->ringsz) {
+		n = ch->ringsz ? ch->ringsz * 2 : SZ_ACHRING;
+		b = (int16_t *)malloc(n * 4);
+		if (!b)
+			return;		/* drop it */
+		for (a = 0; ch->rd + a != ch->wr; a++) {
+			b[a * 2 + 0] = ch->ring[((ch->rd + a) & (ch->ringsz - 1)) * 2 + 0];
+			b[a * 2 + 1] = ch->ring[((ch->rd + a) & (ch->ringsz - 1)) * 2 + 1];
+		}
+		free(ch->ring);
+		ch->ring = b;
+		ch->ringsz = n;
+		ch->wr = a;
+		ch->rd = 0;
+	}
+	a = ch->wr++ & (ch->ringsz - 1);
+	ch->ring[a * 2 + 0] = l;
+	ch->ring[a * 2 + 1] = r;
+}
+
+/* add an input frame: apply the gain, and resample it to the mixer rate
+ * by linear interpolation.
+ */
+static void achan_frame(struct sanachan *ch, int l, int r)
+{
+	l = (l * ch->gl) >> 7;
+	r = (r * ch->gr) >> 7;
+	if (ch->step == 0x10000) {
+		achan_put(ch, l, r);
+		return;
+	}
+	while (ch->phase < 0x10000) {
+		achan_put(ch, ch->prev[0] + (((l - ch->prev[0]) * (int)(ch->phase >> 2)) >> 14),
+			      ch->prev[1] + (((r - ch->prev[1]) * (int)(ch->phase >> 2)) >> 14));
+		ch->phase += ch->step;
+	}
+	ch->phase -= 0x10000;
+	ch->prev[0] = l;
+	ch->prev[1] = r;
+}
+
+static void achan_sample(struct sanachan *ch, int16_t s)
+{
+	if (ch->chans == 1) {
+		achan_frame(ch, s, s);
+	} else if (!ch->half) {
+		ch->hs = s;
+		ch->half = 1;
+	} else {
+		achan_frame(ch, ch->hs, s);
+		ch->half = 0;
+	}
+}
+
+/* decode sample data: 8bit unsigned, 16bit signed BE, or 12bit packed
+ * (3 bytes for 2 samples).  Sample units may be split between packets.
+ */
+static void achan_data(struct sanachan *ch, const uint8_t *src, uint32_t size)
+{
+	const uint8_t u = (ch->bits == 12) ? 3 : ch->bits >> 3;
+	uint8_t *p = ch->part;
+
+	size = _min(size, ch->left);
+	ch->left -= size;
+	while (size--) {
+		p[ch->npart++] = *src++;
+		if (ch->npart < u)
+			continue;
+		ch->npart = 0;
+		if (u == 1) {
+			achan_sample(ch, (p[0] - 0x80) << 8);
+		} else if (u == 2) {
+			achan_sample(ch, (int16_t)(p[0] << 8 | p[1]));
+		} else {
+			achan_sample(ch, ((((p[1] & 0x0f) << 8) | p[0]) << 4) - 0x8000);
+			achan_sample(ch, ((((p[1] & 0xf0) << 4) | p[2]) << 4) - 0x8000);
+		}
+	}
+	if (!ch->left)
+		ch->last = 1;
+}
+
+/* parse the len bytes of a SAUD or iMUS track header we have: the sample
+ * format is in the FRMT chunk of iMUS headers, SAUD is always 8bit mono.
+ * rate is the default for SAUD, size is set to the sample data size.
+ * Returns the offset of the sample data, 0 if more of the header is
+ * needed, or -1 if the track can't be played.
+ */
+static int track_format(uint8_t *h, uint32_t len, uint32_t *bits,
+			uint32_t *chans, uint32_t *rate, uint32_t *size)
+{
+	uint32_t tag, sz, o;
+
+	if (len < 8)
+		return 0;
+	tag = le32_to_cpu(ua32(h));
+	if (tag != SAUD && tag != IMUS)
+		return -1;
+	*bits = 8;
+	*chans = 1;
+	for (o = 8; o + 8 <= len; o += 8 + sz) {
+		tag = le32_to_cpu(ua32(h + o));
+		sz = be32_to_cpu(ua32(h + o + 4));
+		if (tag == SDAT || tag == DATA) {
+			if ((*bits != 8 && *bits != 12 && *bits != 16)
+			    || *chans < 1 || *chans > 2
+			    || *rate < 1000 || *rate > 96000)
+				return -1;
+			*size = sz;
+			return o + 8;
+		}
+		if (tag == IMAP) {	/* FRMT and more are inside */
+			sz = 0;
+			continue;
+		}
+		if (o + 8 + sz > len)
+			break;
+		if (tag == FRMT && sz >= 16) {
+			*bits = be32_to_cpu(ua32(h + o + 12));
+			*rate = be32_to_cpu(ua32(h + o + 16));
+			*chans = be32_to_cpu(ua32(h + o + 20));
+		}
+	}
+	return 0;
+}
+
+/* parse the header of a track collected so far, see track_format() */
+static int achan_header(struct sanachan *ch, uint32_t rate)
+{
+	uint32_t bits, chans;
+	int o;
+
+	o = track_format(ch->hdr, ch->hlen, &bits, &chans, &rate, &ch->left);
+	if (o > 0) {
+		ch->bits = bits;
+		ch->chans = chans;
+		ch->step = ((uint64_t)rate << 16) / MIX_RATE;
+	}
+	return (o == 0 && ch->hlen == SZ_ACHHDR) ? -1 : o;
+}
+
+/* find the track for a packet.  A packet with index 0 starts a track, and
+ * the rest of a previous one on the same track id still plays.  Others
+ * without their track are dropped, e.g. after a seek.
+ */
+static struct sanachan *achan_get(struct sanctx *ctx, uint32_t key,
+				  uint16_t index)
+{
+	struct sanrt *rt = &ctx->rt;
+	struct sanachan *ch, *fr = NULL;
+	int i;
+
+	if (!rt->mix) {
+		if (index != 0)
+			return NULL;
+		rt->mix = (struct sanmix *)malloc(sizeof(struct sanmix));
+		if (!rt->mix)
+			return NULL;
+		memset(rt->mix, 0, sizeof(struct sanmix));
+		rt->mix->pos = mix_time(rt, rt->currframe);
+	}
+	for (i = 0, ch = rt->mix->ch; i < SANDEC_MAXACHAN; i++, ch++) {
+		if (ch->state != ACH_FREE && ch->key == key && !ch->last)
+			break;
+		if (ch->state == ACH_FREE && !fr)
+			fr = ch;
+	}
+	if (i == SANDEC_MAXACHAN)
+		ch = NULL;
+	if (index != 0)
+		return ch;
+	if (ch && ch->rd != ch->wr) {
+		ch->last = 1;	/* plays out, the new one takes over */
+		ch = fr;
+	} else if (!ch) {
+		ch = fr;
+	}
+	if (!ch)
+		return NULL;	/* all in use */
+
+	ch->key = key;
+	ch->state = ACH_HDR;
+	ch->hlen = 0;
+	ch->npart = 0;
+	ch->half = 0;
+	ch->last = 0;
+	ch->phase = 0;
+	ch->prev[0] = ch->prev[1] = 0;
+	return ch;
+}
+
+/* feed the data of a packet to its track */
+static void achan_feed(struct sanctx *ctx, struct sanachan *ch, uint8_t *src,
+		       uint32_t size, uint32_t rate)
+{
+	uint32_t n;
+	int o;
+
+	if (ch->state == ACH_HDR) {
+		n = _min(size, (uint32_t)(SZ_ACHHDR - ch->hlen));
+		memcpy(ch->hdr + ch->hlen, src, n);
+		ch->hlen += n;
+		src += n;
+		size -= n;
+		o = achan_header(ch, rate);
+		if (o < 0)
+			ch->state = ACH_SKIP;
+		if (o <= 0)
+			return;
+		ch->state = ACH_DATA;
+		achan_data(ch, ch->hdr + o, ch->hlen - o);
+	}
+	if (ch->state == ACH_DATA)
+		achan_data(ch, src, size);
+}
+
+/* gain from volume (0-127) and panning (-128 left to 127 right) */
+static void achan_gain(struct sanachan *ch, int vol, int pan)
+{
+	vol = (vol >= 127) ? 128 : vol;
+	ch->gl = (vol * (pan > 0 ? 128 - pan : 128)) >> 7;
+	ch->gr = (vol * (pan < 0 ? 128 + pan : 128)) >> 7;
+}
+
+/* PSAD: a packet of a SAUD track */
+static void handle_PSAD(struct sanctx *ctx, uint32_t size, uint8_t *src)
+{
+	struct sanrt *rt = &ctx->rt;
+	uint16_t track, index, nframes, flags;
+	struct sanachan *ch;
+
+	if (size < 10)
+		return;
+	track =   le16_to_cpu(ua16(src + 0));
+	index =   le16_to_cpu(ua16(src + 2));
+	nframes = le16_to_cpu(ua16(src + 4));
+	flags =   le16_to_cpu(ua16(src + 6));
+	if (flags & 128)
+		return;
+
+	ch = achan_get(ctx, track, index);
+	if (!ch)
+		return;
+	achan_gain(ch, src[8], (int8_t)src[9]);
+	if (index + 1 >= nframes)
+		ch->last = 1;
+	achan_feed(ctx, ch, src + 10, size - 10,
+		   rt->samplerate ? rt->samplerate : MIX_RATE);
+}
+
+/* IACT with an iMUSE track packet, The Dig */
+static void iact_imuse(struct sanctx *ctx, uint32_t size, uint8_t *src)
+{
+	uint16_t flags, track, index, nframes;
+	struct sanachan *ch;
+	uint32_t key;
+	int vol;
+
+	flags =   le16_to_cpu(ua16(src + 6));
+	track =   le16_to_cpu(ua16(src + 8));
+	index =   le16_to_cpu(ua16(src + 10));
+	nframes = le16_to_cpu(ua16(src + 12));
+
+	/* the flags select a group of tracks and their volume */
+	if (flags >= 1 && flags <= 3) {
+		key = flags * 100;
+		vol = 127;
+	} else if (flags >= 100 && flags <= 363 && (flags % 100) < 64) {
+		key = (flags / 100 + 3) * 100;
+		vol = (flags % 100) * 2;
+	} else {
+		return;
+	}
+
+	ch = achan_get(ctx, 0x10000 | (key + track), index);
+	if (!ch)
+		return;
+	achan_gain(ch, vol, 0);
+	if (index + 1 >= nframes)
+		ch->last = 1;
+	achan_feed(ctx, ch, src + 18, size - 18, MIX_RATE);
+}
+
+static void handle_IACT(struct sanctx *ctx, uint32_t size, uint8_t *src)
+{
+	uint16_t *p = (uint16_t *)src;
+
+	if (size < 18)
+		return;
+	if (p[0] == 8 && p[1] == 46) {
+		if (p[3] == 0) {
+			/* subchunkless scaled IACT audio codec47/48 videos */
+			iact_audio_scaled(ctx, size - 18, src + 18);
+		} else {
+			iact_imuse(ctx, size, src);
+		}
+	}
+}
+
+/* subtitles: index of message in the Outlaws LOCAL.MSG file, 10000 - 12001.
+ * As long as subid is set to non-zero, the subtitle needs to be overlaid
+ * over the image.  The chunk also provides hints about where to place
+ * the subtitle, which we ignore here.
+ */
+static void handle_TRES(struct sanctx *ctx, uint32_t size, uint8_t *src)
+{
+	uint16_t *tres = (uint16_t *)src;
+	ctx->rt.subid = size >= 10 ? le16_to_cpu(tres[8]) : 0;
+}
+
+static void handle_STOR(struct sanctx *ctx, uint32_t size, uint8_t *src)
+{
+	ctx->rt.to_store = 1;
+}
+
+static void handle_FTCH(struct sanctx *ctx, uint32_t size, uint8_t *src)
+{
+	struct sanrt *rt = &ctx->rt;
+	int32_t xoff, yoff, rx, ry;
+	uint8_t *db, *dst;
+	int i, j;
+
+	if (size != 12) {
+		xoff = *(int16_t *)(src + 2);
+		yoff = *(int16_t *)(src + 4);
+	} else {
+		xoff = be32_to_cpu(ua32(src + 4));
+		yoff = be32_to_cpu(ua32(src + 8));
+	}
+
+	ctx->rt.dmapref = NULL;
+	ctx->rt.c37ref = NULL;
+	ctx->rt.cmap_all = 1;
+	if (ctx->rt.buf0) {
+		if (xoff == 0 && yoff == 0) {
+			/* nothing to do if buf0 still has the STOR image */
+			if (rt->stor != rt->buf0 || rt->b0src) {
+				buf_touch(ctx, rt->buf0);
+				memcpy(rt->buf0, rt->stor, rt->fbsize);
+			}
+			if (rt->b0src && rt->vbuf == rt->b0src)
+				rt->vbuf = rt->buf0;
+			rt->b0src = NULL;
+		} else {
+			buf0_sync(ctx);
+			db = rt->stor;
+			dst = ctx->rt.buf0;
+			for (i = 0; i < ctx->rt.bufh; i++) {
+				ry = (yoff + i) * ctx->rt.pitch;
+				if (ry < 0 || ry > ctx->rt.bufh)
+					continue;
+				for (j = 0; j < ctx->rt.bufw; j++) {
+					rx = xoff + j;
+					if (rx < 0 || rx > ctx->rt.bufw)
+						continue;
+					*(dst + ry + rx) = *(db + i * ctx->rt.pitch + j);
+				}
+			}
 		}
-		dst += w * 4;
-		db += w * 4;
+		ctx->rt.have_frame = 1;
 	}
 }
 
-static void codec37_comp3(uint8_t *src, uint8_t *dst, uint8_t *db, uint16_t w, uint16_t h,
-			  uint8_t mvidx, const uint8_t f4, const uint8_t c4)
+/* collect FRME index information from a chunk.  For FOBJs, at least the
+ * first 32 bytes of src need to be valid.
+ */
+static void fidx_chunk(struct sanfidx *fi, uint32_t cid, uint32_t csz, uint8_t *src)
 {
-	uint8_t opc, c, copycnt;
-	int32_t ofs, mvofs;
-	int i, j, k, l;
+	uint8_t codec;
+
+	switch (cid) {
+	case NPAL: fi->flags |= FIDX_NPAL; break;
+	case XPAL: fi->flags |= FIDX_XPAL; break;
+	case STOR: fi->flags |= FIDX_STOR; break;
+	case FTCH: fi->flags |= FIDX_FTCH; break;
+	case FOBJ:
+		if (csz < 14)
+			break;
+		codec = src[0];
+		if (!fi->codec)
+			fi->codec = codec;
+		if (csz < 32)
+			break;
+		src += 14;
+		if (codec == 47) {
+			if (le16_to_cpu(ua16(src + 0)) == 0)
+				fi->flags |= FIDX_KEY;
+			if (src[4] & 1)
+				fi->flags |= FIDX_ITBL;
+		} else if (codec == 48) {
+			if (le16_to_cpu(ua16(src + 2)) == 0)
+				fi->flags |= FIDX_KEY;
+			if (src[12] & 8)
+				fi->flags |= FIDX_ITBL;
+		} else if (codec == 37) {
+			if (src[0] == 0 || src[0] == 2)
+				fi->flags |= FIDX_KEY;
+		}
+		break;
+	default: break;
+	}
+}
 
-	copycnt = 0;
-	for (i = 0; i < h; i += 4) {
-		for (j = 0; j < w; j += 4) {
+#ifdef SANDEC_STATS
+static void st_chunk(struct sanctx *ctx, uint32_t cid)
+{
+	switch (cid) {
+	case NPAL: ST_COUNT(ctx, npal, 1); break;
+	case FOBJ: ST_COUNT(ctx, fobj, 1); break;
+	case IACT: ST_COUNT(ctx, iact, 1); break;
+	case TRES: ST_COUNT(ctx, tres, 1); break;
+	case STOR: ST_COUNT(ctx, stor, 1); break;
+	case FTCH: ST_COUNT(ctx, ftch, 1); break;
+	case XPAL: ST_COUNT(ctx, xpal, 1); break;
+	case PSAD: ST_COUNT(ctx, psad, 1); break;
+	default:   ST_COUNT(ctx, other, 1);
+	}
+}
+#endif
 
-			/* copy a 4x4 block from the previous frame from same spot */
-			if (copycnt > 0) {
-c37_blk:
-				for (k = 0; k < 4; k++) {
-					ofs = j + (k * w);
-					for (l = 0; l < 4; l++) {
-						*(dst + ofs + l) = *(db + ofs + l);
-					}
-				}
-				copycnt--;
-				continue;
+/******************************************************************************/
+/* PackBits-style RLE: a control byte c below 128 is followed by c + 1
+ * literal bytes, one from 128 up by a byte repeated c - 125 times.
+ */
+#define RLE_BOUND(n)	((n) + ((n) + 127) / 128)
+
+static uint32_t rle_pack(uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+	uint8_t *d = dst;
+	uint32_t i = 0, r, lit = 0;
+
+	while (i < n) {
+		for (r = 1; i + r < n && r < 130 && src[i + r] == src[i]; r++)
+			;
+		if (r >= 3) {
+			*d++ = r + 125;
+			*d++ = src[i];
+			i += r;
+			continue;
+		}
+		/* collect literals until the next run of 3 */
+		lit = i;
+		while (i < n && i - lit < 128
+		       && !(i + 2 < n && src[i] == src[i + 1] && src[i] == src[i + 2]))
+			i++;
+		*d++ = i - lit - 1;
+		memcpy(d, src + lit, i - lit);
+		d += i - lit;
+	}
+	return d - dst;
+}
+
+/* unpack exactly n bytes to dst from at most len bytes at src.  Returns
+ * the number of bytes used from src, or -1 if they don't fit.
+ */
+static int rle_unpack(uint8_t *dst, uint32_t n, const uint8_t *src,
+		      uint32_t len)
+{
+	uint32_t i = 0, o = 0, c;
+
+	while (o < n) {
+		if (i >= len)
+			return -1;
+		c = src[i++];
+		if (c < 128) {
+			c += 1;
+			if (c > n - o || c > len - i)
+				return -1;
+			memcpy(dst + o, src + i, c);
+			i += c;
+		} else {
+			c -= 125;
+			if (c > n - o || i >= len)
+				return -1;
+			memset(dst + o, src[i++], c);
+		}
+		o += c;
+	}
+	return i;
+}
+
+/******************************************************************************/
+/* decoded frame cache: the decoded images are kept RLE-packed with their
+ * palette, so that seeks into frames seen recently don't need any decoding.
+ * While frames are served from it, the decoder state stays at the frame
+ * it was; only the palette holds the one of the served frame.
+ */
+
+static void fc_unlink(struct sanfc *fc, struct sanfcent *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		fc->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		fc->tail = e->prev;
+}
+
+static void fc_link(struct sanfc *fc, struct sanfcent *e)
+{
+	e->prev = NULL;
+	e->next = fc->head;
+	if (fc->head)
+		fc->head->prev = e;
+	fc->head = e;
+	if (!fc->tail)
+		fc->tail = e;
+}
+
+static void fc_use(struct sanfc *fc, struct sanfcent *e)
+{
+	if (fc->head == e)
+		return;
+	fc_unlink(fc, e);
+	fc_link(fc, e);
+}
+
+static void fc_drop(struct sanfc *fc, struct sanfcent *e)
+{
+	fc_unlink(fc, e);
+	fc->idx[e->frame] = NULL;
+	fc->used -= sizeof(struct sanfcent) + e->size;
+	free(e);
+}
+
+/* drop the least recently used entries until the budget fits */
+static void fc_trim(struct sanfc *fc, uint32_t budget)
+{
+	while (fc->tail && fc->used > budget)
+		fc_drop(fc, fc->tail);
+}
+
+static void fc_free(struct sanfc *fc)
+{
+	fc_trim(fc, 0);
+	free(fc->idx);
+	fc->idx = NULL;
+	fc->serve = 0;
+	fc->dirty = 0;
+}
+
+/* add the frame just decoded */
+static void fc_put(struct sanctx *ctx)
+{
+	struct sanrt *rt = &ctx->rt;
+	struct sanfc *fc = &ctx->fc;
+	struct sanfcent *e, *e2;
+	uint32_t f = rt->currframe, n;
+
+	if (!fc->budget || f >= rt->FRMEcnt || !rt->vbuf)
+		return;
+	if (!fc->idx) {
+		fc->idx = (struct sanfcent **)malloc(rt->FRMEcnt * sizeof(struct sanfcent *));
+		if (!fc->idx)
+			return;
+		memset(fc->idx, 0, rt->FRMEcnt * sizeof(struct sanfcent *));
+	}
+	if (fc->idx[f]) {
+		fc_use(fc, fc->idx[f]);
+		return;
+	}
+
+	e = (struct sanfcent *)malloc(sizeof(struct sanfcent) + RLE_BOUND(rt->fbsize));
+	if (!e)
+		return;
+	n = rle_pack((uint8_t *)(e + 1), rt->vbuf, rt->fbsize);
+	if (sizeof(struct sanfcent) + n > fc->budget) {
+		free(e);
+		return;
+	}
+	e2 = (struct sanfcent *)realloc(e, sizeof(struct sanfcent) + n);
+	if (e2)
+		e = e2;
+	e->frame = f;
+	e->size = n;
+	e->w = rt->frmw;
+	e->h = rt->frmh;
+	e->bufw = rt->bufw;
+	e->bufh = rt->bufh;
+	e->subid = rt->subid;
+	memcpy(e->pal, rt->palette, SZ_PAL);
+
+	fc_trim(fc, fc->budget - sizeof(struct sanfcent) - n);
+	fc->idx[f] = e;
+	fc->used += sizeof(struct sanfcent) + n;
+	fc_link(fc, e);
+}
+
+/* the entry of a frame, if its image fits the frame buffers */
+static struct sanfcent *fc_get(struct sanctx *ctx, uint32_t f)
+{
+	struct sanrt *rt = &ctx->rt;
+	struct sanfcent *e;
+
+	if (!ctx->fc.idx || f >= rt->FRMEcnt || !rt->buf)
+		return NULL;
+	e = ctx->fc.idx[f];
+	if (!e || e->bufw != rt->bufw || e->bufh != rt->bufh)
+		return NULL;
+	return e;
+}
+
+/* serve frames from the cache, starting with frame f.  Returns 0 if it's
+ * not there.
+ */
+static int fc_seek(struct sanctx *ctx, uint32_t f)
+{
+	struct sanfc *fc = &ctx->fc;
+
+	if (!fc_get(ctx, f))
+		return 0;
+	if (!fc->serve) {
+		fc->err = ctx->errdone;
+		fc->serve = 1;
+	}
+	fc->pos = f;
+	/* a pending interpolated frame's decoded one is in the cache, too */
+	ctx->rt.have_ipframe = 0;
+	ctx->errdone = 0;
+	return 1;
+}
+
+/* back to decoding: the decoder's palette returns */
+static void fc_leave(struct sanctx *ctx)
+{
+	struct sanfc *fc = &ctx->fc;
+
+	if (fc->dirty) {
+		if (memcmp(ctx->rt.palette, fc->pal, SZ_PAL)) {
+			memcpy(ctx->rt.palette, fc->pal, SZ_PAL);
+			ctx->palgen++;
+		}
+		fc->dirty = 0;
+	}
+	fc->serve = 0;
+}
+
+/* pass out the next frame from the cache.  Returns 1 if one was, else the
+ * decoder takes over again at that frame.
+ */
+static int fc_next(struct sanctx *ctx)
+{
+	struct sanrt *rt = &ctx->rt;
+	struct sanfc *fc = &ctx->fc;
+	struct sanfcent *e;
+	uint16_t w, h, subid;
+
+	e = fc_get(ctx, fc->pos);
+	if (!e)
+		return 0;
+	if (!fc->dirty) {
+		memcpy(fc->pal, rt->palette, SZ_PAL);
+		fc->dirty = 1;
+	}
+	/* the generation changes with the palette only */
+	if (memcmp(rt->palette, e->pal, SZ_PAL)) {
+		memcpy(rt->palette, e->pal, SZ_PAL);
+		ctx->palgen++;
+	}
+
+	/* buf5 is only used for interpolated frames */
+	buf_touch(ctx, rt->buf5);
+	rle_unpack(rt->buf5, rt->fbsize, (uint8_t *)(e + 1), e->size);
+	w = rt->frmw;
+	h = rt->frmh;
+	subid = rt->subid;
+	rt->frmw = e->w;
+	rt->frmh = e->h;
+	rt->subid = e->subid;
+	rt->lastout = NULL;
+	queue_image(ctx, rt->buf5, rt->framedur, 0);
+	rt->frmw = w;
+	rt->frmh = h;
+	rt->subid = subid;
+
+	ST_COUNT(ctx, fchit, 1);
+	fc_use(fc, e);
+	fc->pos++;
+	return 1;
+}
+
+/* decode all audio chunks of a FRME; runs on a worker thread */
+static void frme_audio(struct sanctx *ctx, void *arg)
+{
+	struct sanwork *wk = (struct sanwork *)arg;
+	uint32_t cid, csz, size = wk->len;
+	uint8_t *src = wk->src;
+
+	while (size > 7) {
+		cid = le32_to_cpu(ua32(src + 0));
+		csz = be32_to_cpu(ua32(src + 4));
+		src += 8;
+		size -= 8;
+		if (csz > size)
+			break;
+		if (cid == IACT)
+			ST_TIME(ctx, SANDEC_ST_IACT, handle_IACT(ctx, csz, src));
+		else if (cid == PSAD)
+			ST_TIME(ctx, SANDEC_ST_IACT, handle_PSAD(ctx, csz, src));
+		if (csz & 1)
+			csz += 1;
+		if (csz > size)
+			break;
+		src += csz;
+		size -= csz;
+	}
+	mix_frame(ctx);
+}
+
+static int handle_FRME(struct sanctx *ctx, uint32_t size, uint8_t *src,
+		       struct sanfidx *fi)
+{
+	struct sanrt *rt = &ctx->rt;
+	uint32_t cid, csz;
+	struct sanwork aw;
+	int ret = 0, apending = 0, changes, aonly, vonly, drop;
+
+	/* no changes to the image so far */
+	rt->cmapref = NULL;
+	rt->cmap_all = !ctx->io->queue_video_rects && !rt->osize;
+	aonly = !!(ctx->io->flags & SANDEC_FLAG_AUDIO_ONLY);
+	vonly = !!(ctx->io->flags & SANDEC_FLAG_VIDEO_ONLY);
+
+	/* with worker threads, decode the audio alongside the video */
+	if (ctx->pool && !aonly && !vonly) {
+		aw.src = src;
+		aw.len = size;
+		rt->aqlen = 0;
+		rt->aqdefer = 1;
+		pool_run(ctx, frme_audio, &aw, &apending);
+	}
+
+	while ((size > 7) && (ret == 0)) {
+		cid = le32_to_cpu(ua32(src + 0));
+		csz = be32_to_cpu(ua32(src + 4));
+
+		src += 8;
+		size -= 8;
+
+		if (csz > size) {
+			ret = 17;
+			break;
+		}
+
+		if (fi)
+			fidx_chunk(fi, cid, csz, src);
+		ST_DO(st_chunk(ctx, cid));
+
+		/* audio or video only: walk over the other chunks */
+		if (aonly ? (cid != IACT && cid != PSAD)
+			  : (vonly && (cid == IACT || cid == PSAD)))
+			goto next;
+
+		switch (cid)
+		{
+		case NPAL: ST_TIME(ctx, SANDEC_ST_NPAL, handle_NPAL(ctx, csz, src)); break;
+		case FOBJ: ret = handle_FOBJ(ctx, csz, src); break;
+		case IACT: if (!rt->aqdefer)
+				ST_TIME(ctx, SANDEC_ST_IACT, handle_IACT(ctx, csz, src));
+			   break;
+		case PSAD: if (!rt->aqdefer)
+				ST_TIME(ctx, SANDEC_ST_IACT, handle_PSAD(ctx, csz, src));
+			   break;
+		case TRES: handle_TRES(ctx, csz, src); break;
+		case STOR: handle_STOR(ctx, csz, src); break;
+		case FTCH: ST_TIME(ctx, SANDEC_ST_FTCH, handle_FTCH(ctx, csz, src)); break;
+		case XPAL: ST_TIME(ctx, SANDEC_ST_XPAL, ret = handle_XPAL(ctx, csz, src)); break;
+		default:   ret = 0;     /* unknown chunk, ignore */
+		}
+next:
+		/* all objects in the SAN stream are padded so their length
+		 * is even. */
+		if (csz & 1)
+			csz += 1;
+		src += csz;
+		size -= csz;
+	}
+
+	if (!rt->aqdefer)
+		mix_frame(ctx);
+	if (rt->aqdefer) {
+		pool_wait(ctx, &apending);
+		rt->aqdefer = 0;
+		if (rt->aqlen)
+			ctx->io->queue_audio(ctx->io->userctx, rt->aq, rt->aqlen);
+	}
+
+	/* OK case: all usable bytes of the FRME read, no errors */
+	if (ret == 0) {
+		if (ctx->rt.have_frame) {
+			if (rt->to_store)	/* STOR */
+				rt->stor = rt->vbuf;
+			fc_put(ctx);
+
+			/* if possible, interpolate a frame using the itable,
+			 * and queue that plus the decoded one.
+			 */
+			/* the change map is usable if it is relative to the
+			 * last image passed out, with the same palette: a
+			 * palette change in a FRME without images changes
+			 * everything, too.
+			 */
+			changes = !rt->cmap_all && rt->cmapref
+				  && (rt->cmapref == rt->lastout)
+				  && (rt->lastpalgen == ctx->palgen);
+
+			/* decimation: drop all but every decim'th frame */
+			drop = 0;
+			if (ctx->decim > 1 && !rt->quiet) {
+				drop = !!rt->dskip;
+				rt->dskip = drop ? rt->dskip - 1 : ctx->decim - 1;
 			}
 
-			opc = *src++;
-			if (opc == 0xff) {
-				/* 4x4 block, per-pixel data from source */
-				for (k = 0; k < 4; k++) {
-					ofs = j + (k * w);
-					for (l = 0; l < 4; l++)
-						*(dst + ofs + l) = *src++;
-				}
-			} else if (f4 && (opc == 0xfe)) {
-				/* 4x4 block, per-line color from source */
-				for (k = 0; k < 4; k++) {
-					c = *src++;
-					ofs = j + (k * w);
-					for (l = 0; l < 4; l++)
-						*(dst + ofs + l) = c;
-				}
-			} else if (f4 && (opc == 0xfd)) {
-				/* 4x4 block, per block color from source */
-				c = *src++;
-				for (k = 0; k < 4; k++) {
-					ofs = j + (k * w);
-					for (l = 0; l < 4; l++)
-						*(dst + ofs + l) = c;
+			if (rt->quiet || drop) {
+				/* catching up to a seek target, or dropped:
+				 * no output
+				 */
+				rt->can_ipol = 0;
+				rt->lastout = NULL;
+				if (drop && rt->have_itable)
+					rt->ipref = rt->vbuf;
+			} else if (ctx->io->flags & SANDEC_FLAG_DO_FRAME_INTERPOLATION
+			    && ctx->decim < 2
+			    && rt->have_itable
+			    && rt->can_ipol) {
+				uint8_t *dm = (rt->dmapref && rt->dmapref == rt->ipref) ? rt->dmap : NULL;
+
+				/* only the changed blocks differ from both the
+				 * last and the new image then.
+				 */
+				rt->ipol_same = changes && dm && ipol_ident(rt->c47ipoltbl);
+				if (rt->obpp) {
+					/* interpolate straight into the output
+					 * format.  If it still has the last
+					 * image, only the changed blocks need
+					 * to be done.
+					 */
+					uint8_t *out = ctx->obufu ? ctx->obufu : rt->obuf;
+					int keep = rt->ipol_same && rt->olast == out
+						   && rt->lastout == rt->ipref;
+
+					buf_touch(ctx, out);
+					ST_TIME(ctx, SANDEC_ST_IPOL,
+						interpolate_frame_mt(ctx, out, rt->ipref, rt->vbuf,
+								     rt->c47ipoltbl, keep ? dm : NULL,
+								     pal_derive(ctx, ctx->ofmt), rt->obpp,
+								     rt->bufw, rt->bufh));
+					rt->oready = 1;
+				} else {
+					buf_touch(ctx, rt->buf5);
+					ST_TIME(ctx, SANDEC_ST_IPOL,
+						interpolate_frame_mt(ctx, rt->buf5, rt->ipref, rt->vbuf,
+								     rt->c47ipoltbl, dm, NULL, 0,
+								     rt->bufw, rt->bufh));
 				}
-			} else if (c4 && (opc == 0)) {
-				/* copy 4x4 block from prev frame, cnt from src */
-				copycnt = 1 + *src++;
-				goto c37_blk; /* curr. block needs to be handled too */
+				rt->have_ipframe = 1;
+				rt->can_ipol = 0;
+				rt->ipref = rt->vbuf;
+				rt->lastout = rt->vbuf;
+				rt->lastpalgen = ctx->palgen;
+				queue_image(ctx, rt->buf5, rt->framedur / 2, rt->ipol_same);
 			} else {
-				/* 4x4 block copy from prev with MV */
-				mvofs = c37_mv[mvidx][opc*2] + (c37_mv[mvidx][opc*2 + 1] * w);
-				for (k = 0; k < 4; k++) {
-					ofs = j + (k * w);
-					for (l = 0; l < 4; l++)
-						*(dst + ofs + l) = *(db + ofs + l + mvofs);
-				}
+				queue_image(ctx, rt->vbuf, rt->framedur, changes);
+				/* save frame as possible interpolation source */
+				if (rt->have_itable)
+					rt->ipref = rt->vbuf;
+				rt->lastout = rt->vbuf;
+				rt->lastpalgen = ctx->palgen;
 			}
 		}
-		dst += w * 4;
-		db += w * 4;
+
+		rt->to_store = 0;
+		rt->currframe++;
+		rt->subid = 0;
+		rt->have_frame = 0;
+	} else {
+		rt->lastout = NULL;
+	}
+
+	return ret;
+}
+
+static int handle_AHDR(struct sanctx *ctx, uint32_t size)
+{
+	struct sanrt *rt = &ctx->rt;
+	uint8_t *ahbuf, *xbuf = NULL;
+	uint32_t maxframe;
+	int ret = SANDEC_OK;
+
+	ahbuf = (uint8_t *)malloc(size);
+	if (!ahbuf)
+		return 5;
+	if (read_source(ctx, ahbuf, size)) {
+		ret = 6;
+		goto out;
 	}
-}
-
-static int codec37(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h,
-		   uint16_t top, uint16_t left)
-{
-	uint8_t comp, mvidx, flag, *dst, *db;
-	uint32_t decsize;
-	uint16_t seq;
-	int ret;
 
-	comp = src[0];
-	mvidx = src[1];
-	if (mvidx > 2)
-		return 18;
-	seq = le16_to_cpu(*(uint16_t *)(src + 2));
-	decsize = le32_to_cpu(ua32(src + 4));
-	flag = src[12];
+	rt->version = le16_to_cpu(*(uint16_t *)(ahbuf + 0));
+	rt->FRMEcnt = le16_to_cpu(*(uint16_t *)(ahbuf + 2));
+	rt->ahdrhash = fnv1a(ahbuf, size, 2166136261U);
 
-	if (comp == 0 || comp == 2) {
-		memset(ctx->rt.buf2, 0, decsize);
+	/* allocate memory for static work buffers */
+	xbuf = malloc(SZ_ALL);
+	if (!xbuf) {
+		ret = 8;
+		goto out;
 	}
 
-	/* Codec37's  buffers are private, no other codec must touch them.
-	 * Therefore we operate on buf1/buf2 rather than buf0/buf2, since
-	 * buf0 is also touched by default by other codecs, and this results
-	 * in unexpected image issues.
-	 * Unlike c47, buffers need to be pre-rotated.
-	 */
-	if ((comp == 1 || comp == 3 || comp == 4)
-	    && ((seq & 1) || !(flag & 1))) {
-		void *tmp = ctx->rt.buf1;
-		ctx->rt.buf1 = ctx->rt.buf2;
-		ctx->rt.buf2 = tmp;
-	}
+	rt->iactbuf = (uint8_t *)xbuf;
+	rt->palette = (uint32_t *)((uint8_t *)(rt->iactbuf) + SZ_IACT);
+	rt->deltapal = (int16_t *)((uint8_t *)rt->palette + SZ_PAL);
+	rt->c47ipoltbl = (uint8_t *)rt->deltapal + SZ_DELTAPAL;
+	rt->abuf = (uint8_t *)rt->c47ipoltbl + SZ_C47IPTBL;
+	rt->ahdrpal = (uint32_t *)(rt->abuf + SZ_AUDIOOUT);
+	rt->rects = (struct sanrect *)((uint8_t *)rt->ahdrpal + SZ_PAL);
+	rt->dpal = (uint32_t *)(rt->rects + SZ_RECTS);
+	memset(xbuf, 0, SZ_ALL);
 
-	src += 16;
-	ret = 0;
-	dst = ctx->rt.buf1 + (top * w) + left;
-	db = ctx->rt.buf2 + (top * w) + left;
+	read_palette(ctx, ahbuf + 6);	/* 768 bytes */
+	memcpy(rt->ahdrpal, rt->palette, SZ_PAL);
 
-	switch (comp) {
-	case 0: memcpy(dst, src, decsize); break;
-	case 1: codec37_comp1(src, dst, db, w, h, mvidx); break;
-	case 2: codec47_comp5(src, dst, decsize); break;
-	case 3: /* fallthrough */
-	case 4: codec37_comp3(src, dst, db, w, h, mvidx, flag & 4, comp == 4); break;
-	default: break;
+	if (rt->version > 1) {
+		rt->framedur  =  le32_to_cpu(*(uint32_t *)(ahbuf + 6 + 768 + 0));
+		rt->framedur = 1000000 / rt->framedur;
+		maxframe =       le32_to_cpu(*(uint32_t *)(ahbuf + 6 + 768 + 4));
+		rt->samplerate = le32_to_cpu(*(uint32_t *)(ahbuf + 6 + 768 + 8));
+
+		/* "maxframe" indicates the maximum size of one FRME object
+		 * including chunk ID and chunk size in the stream (usually the first)
+		 * plus 1 byte.
+		 */
+		if ((maxframe > 9) && (maxframe < 4 * 1024 * 1024) && !rt->mem) {
+			ret = allocfrme(ctx, maxframe);
+		}
+	} else {
+		rt->framedur = 1000000 / 10;	/* ANIMv1 default */
+		rt->samplerate = 11025;		/* ANIMv1 default */
+		rt->frmebufsz = 0;
 	}
 
-	/* copy the final image to buf0 in case another codec needs to operate
-	 * on it.
-	 */
-	memcpy(ctx->rt.buf0, ctx->rt.buf1, ctx->rt.fbsize);
-	ctx->rt.lastseq = seq;
+out:
+	if ((ret != SANDEC_OK) && xbuf)
+		free(xbuf);
 
+	free(ahbuf);
 	return ret;
 }
 
 /******************************************************************************/
+/* FRME read-ahead */
 
-static void codec1(struct sanctx *ctx, uint8_t *src, uint16_t w, uint16_t h,
-		   int16_t top, int16_t left)
+#ifndef SANDEC_NO_THREADS
+
+/* reader thread: fill free ring slots with the following FRMEs, until told
+ * to stop or the stream ends.
+ */
+static void *ra_thread(void *arg)
 {
-	uint8_t *dst, code, col;
-	uint16_t rlen, dlen;
-	int i, j;
+	struct sanctx *ctx = (struct sanctx *)arg;
+	struct sanra *ra = ctx->ra;
+	struct sanraslot *sl;
+	uint32_t c[2], sz;
+	uint8_t *b;
+	int err;
 
-	for (i = 0; i < h; i++) {
-		dst = ctx->rt.buf0 + ((top + i) * ctx->rt.pitch) + left;
-		dlen = le16_to_cpu(ua16(src)); src += 2;
-		while (dlen > 0) {
-			code = *src++; dlen--;
-			rlen = (code >> 1) + 1;
-			if (code & 1) {
-				col = *src++; dlen--;
-				if (col)
-					for (j = 0; j < rlen; j++)
-						*(dst + j) = col;
-				dst += rlen;
-			} else {
-				for (j = 0; j < rlen; j++) {
-					col = *src++;
-					if (col)
-						*dst = col;
-					dst++;
+	pthread_mutex_lock(&ra->mtx);
+	while (!ra->stop) {
+		if (ra->count == ra->depth) {
+			pthread_cond_wait(&ra->cond, &ra->mtx);
+			continue;
+		}
+		sl = &ra->slot[(ra->head + ra->count) % ra->depth];
+		pthread_mutex_unlock(&ra->mtx);
+
+		err = 0;
+		sl->ofs = ra->pos;
+		sl->size = 0;
+		if (!ctx->io->ioread(ctx->io->userctx, c, 8)) {
+			err = 1;
+		} else if (c[0] != FRME) {
+			err = 4;
+		} else {
+			sl->size = be32_to_cpu(c[1]);
+			if (sl->size > sl->bufsz) {
+				sz = (sl->size + 31) & ~31;
+				b = (uint8_t *)realloc(sl->buf, sz);
+				if (b) {
+					sl->buf = b;
+					sl->bufsz = sz;
 				}
-				dlen -= rlen;
 			}
+			if (sl->size > sl->bufsz)
+				err = 1;
+			else if (!ctx->io->ioread(ctx->io->userctx, sl->buf, sl->size))
+				err = 10;
 		}
+		sl->err = err;
+		/* after an error, the stream position is unknown */
+		ra->pos = err ? 0xffffffff : ra->pos + 8 + sl->size;
+
+		pthread_mutex_lock(&ra->mtx);
+		ra->count++;
+		pthread_cond_broadcast(&ra->cond);
+		if (err)
+			break;
 	}
-}
+	pthread_mutex_unlock(&ra->mtx);
 
-/******************************************************************************/
+	return NULL;
+}
 
-static int fobj_alloc_buffers(struct sanrt *rt, uint16_t w, uint16_t h, uint8_t bpp, unsigned align)
+/* start reading ahead from the current position.  If that is not possible,
+ * the FRMEs are simply read synchronously.
+ */
+static void ra_start(struct sanctx *ctx)
 {
-	uint16_t wb, hb;
-	uint32_t bs, fbs;
-	uint8_t *b;
+	struct sanra *ra = ctx->ra;
 
-	if (align > 1) {
-		/* align sizes */
-		align -= 1;
-		wb = (w + align) & ~align;
-		hb = (h + align) & ~align;
-	} else {
-		wb = w;
-		hb = h;
-	}
+	if (ra && ra->running)
+		return;
 
-	/* don't support strides different from image width (yet) */
-	if (wb != w) {
-		return 50;
+	if (!ra) {
+		ra = (struct sanra *)malloc(sizeof(struct sanra) +
+					    ctx->radepth * sizeof(struct sanraslot));
+		if (!ra)
+			return;
+		memset(ra, 0, sizeof(struct sanra) + ctx->radepth * sizeof(struct sanraslot));
+		ra->slot = (struct sanraslot *)(ra + 1);
+		ra->depth = ctx->radepth;
+		pthread_mutex_init(&ra->mtx, NULL);
+		pthread_cond_init(&ra->cond, NULL);
+		ctx->ra = ra;
 	}
 
-	/* we require up to 3 buffers the size of the image.
-	 * a front buffer + 2 work buffers,  a buffer used to store
-	 * the frontbuffer on "STOR" and an 2 intermediate buffers for
-	 * interpolated frames (c47/c48 videos only).
-	 *
-	 * Then we need a "guard band" before and after the buffers for motion
-	 * vectors that point outside the defined video area, esp. for codec37
-	 * and codec48.  32 lines (max of mvec tables) is enough to get rid of
-	 * all tiny artifacts.
-	 */
-	bs = wb * hb * bpp;		/* block-aligned 8 bit sizes */
-	bs = (bs + 0xfff) & ~0xfff;	/* align to 4K */
-	fbs = bs * 6 + (wb * 32 * 4);	/* 4 buffers, 4 guard "bands" */
-	b = (uint8_t *)malloc(fbs);
-	if (!b)
-		return 51;
-	memset(b, 0, fbs);	/* clear everything including the guard bands */
-
-	if (rt->buf)
-		free(rt->buf);
-
-	rt->buf = b;
-	rt->buf0 = b + (wb * 32);	/* leave a guard band for motion vectors */
-	rt->buf1 = rt->buf0 + (wb * 32) + bs;
-	rt->buf2 = rt->buf1 + (wb * 32) + bs;
-	rt->buf3 = rt->buf2 + (wb * 32) + bs;
-	rt->buf4 = rt->buf3 + bs;
-	rt->buf5 = rt->buf4 + bs;
-	rt->fbsize = w * h * bpp;	/* image size reported to caller */
-	rt->bufw = w;			/* buffer (aligned) width */
-	rt->bufh = h;
-
-	return 0;
+	ra->pos = ctx->rt.fpos;
+	ra->head = 0;
+	ra->count = 0;
+	ra->stop = 0;
+	if (0 == pthread_create(&ra->thr, NULL, ra_thread, ctx))
+		ra->running = 1;
 }
 
-static int handle_FOBJ(struct sanctx *ctx, uint32_t size, uint8_t *src)
+/* stop the reader thread.  With resync, the stream is then positioned
+ * after the last FRME handed to the decoder.
+ */
+static int ra_stop(struct sanctx *ctx, int resync)
 {
-	struct sanrt *rt = &ctx->rt;
-	uint16_t w, h, wr, hr, align, param2;
-	uint8_t codec, param;
-	int16_t left, top;
-	int ret;
+	struct sanra *ra = ctx->ra;
 
-	codec = src[0];
-	param = src[1];
-
-	left   = le16_to_cpu(*(int16_t *)(src + 2));
-	top    = le16_to_cpu(*(int16_t *)(src + 4));
-	w = wr = le16_to_cpu(*(uint16_t *)(src + 6));
-	h = hr = le16_to_cpu(*(uint16_t *)(src + 8));
-	param2 = le16_to_cpu(*(uint16_t *)(src + 12));
-
-	align = (codec == 37) ? 4 : 2;
-	align = (codec == 48) ? 8 : align;
-
-	/* ignore too small dimensions in first frames, happens with some
-	 * Full Throttle videos
-	 */
-	if (!rt->fbsize && (w < align || h < align))
+	if (!ra || !ra->running)
 		return 0;
 
-	/* there are some odd-sized frames in RA1, but all seem to work on
-	 * a 320x200 buffer.  Pass 320x200 to the buffer allocator.
-	 * Need also to set a separate pitch since most of the codec1-33 videos
-	 * work on parts of the image and have their dimensions and origin set
-	 * to that part.
-	 */
-	if (rt->version < 2 && (w < 320 || h < 200) && (top == 0) && left == 0) {
-		wr = 320;
-		hr = 200;
-		rt->pitch = 320;
+	pthread_mutex_lock(&ra->mtx);
+	ra->stop = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->mtx);
+	pthread_join(ra->thr, NULL);
+	ra->running = 0;
+
+	if (resync && (ra->count || ra->pos != ctx->rt.fpos)) {
+		ra->count = 0;
+		if (!can_seek(ctx) || seek_source(ctx, ctx->rt.fpos))
+			return 70;
 	}
+	ra->count = 0;
+	return 0;
+}
 
-	/* disable left/top for codec47/48 videos.  Except for SotE, none use
-	 * it, and SotE uses it as a hack to get "widescreen" aspect, i.e. it's
-	 * just a black bar of 60 pixels heigth at the top.
-	 */
-	if (codec == 47 || codec == 48) {
-		rt->pitch = w;
-		left = top = 0;
-	}
+static void ra_free(struct sanctx *ctx)
+{
+	struct sanra *ra = ctx->ra;
+	int i;
 
-	if (rt->pitch == 0 && w >= 300)
-		rt->pitch = w;
+	if (!ra)
+		return;
+	ra_stop(ctx, 0);
+	for (i = 0; i < ra->depth; i++)
+		free(ra->slot[i].buf);
+	pthread_mutex_destroy(&ra->mtx);
+	pthread_cond_destroy(&ra->cond);
+	free(ra);
+	ctx->ra = NULL;
+}
 
-	ret = 0;
-	if ((rt->bufw < (left + wr)) || (rt->bufh < (top + hr))) {
-		ret = fobj_alloc_buffers(rt, _max(rt->bufw, left + wr),
-					 _max(rt->bufh, top + hr), 1, align);
-	}
-	if (ret != 0)
-		return ret;
+/* get the next FRME from the reader, waits only if none is there yet */
+static struct sanraslot *ra_get(struct sanctx *ctx)
+{
+	struct sanra *ra = ctx->ra;
+	struct sanraslot *sl;
 
-	/* default image buffer is buf0 */
-	rt->vbuf = rt->buf0;
+	pthread_mutex_lock(&ra->mtx);
+	while (ra->count == 0)
+		pthread_cond_wait(&ra->cond, &ra->mtx);
+	sl = &ra->slot[ra->head];
+	pthread_mutex_unlock(&ra->mtx);
 
-	switch (codec) {
-	case 1:
-	case 3: codec1(ctx, src + 14, w, h, top, left); break;
-	case 37:ret = codec37(ctx, src + 14, w, h, top, left); break;
-	case 47:ret = codec47(ctx, src + 14, w, h); break;
-	case 48:ret = codec48(ctx, src + 14, w, h); break;
-	default: ret = 10;
-	}
+	return sl;
+}
 
-	if (ret == 0) {
-		ctx->rt.have_frame = 1;
+/* hand the FRME obtained with ra_get() back to the reader */
+static void ra_put(struct sanctx *ctx)
+{
+	struct sanra *ra = ctx->ra;
 
-		/* trust the dimensions in the v2 videos; for older assume 320x200 as
-		 * the final dimensions.
-		 * FIXME: May need to be revisited for RA/RA2.
-		 */
-		if (rt->version > 1) {
-			rt->frmw = _max(rt->frmw, w);
-			rt->frmh = _max(rt->frmh, h);
-		} else {
-			rt->frmw = 320;
-			rt->frmh = 200;
+	pthread_mutex_lock(&ra->mtx);
+	ra->head = (ra->head + 1) % ra->depth;
+	ra->count--;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->mtx);
+}
 
-			/* that few stupid Full Throttle videos which are slightly
-			 * larger but still have the 320x200 visible area.
-			 * Concatenate the visible image area to 320x200 in the
-			 * STOR buffer.
-			 */
-			if (w > 320 && w < 400 && h > 200 && h < 250) {
-				int i, j;
-				for (i = 0; i < 200; i++)
-					for (j = 0; j < 320; j++)
-						*(rt->buf3 + (i * 320) + j) = *(rt->vbuf + (i * w) + j);
-				rt->vbuf = rt->buf3;
-			}
-		}
-	}
+#else
 
-	return ret;
-}
+static void ra_start(struct sanctx *ctx) {}
+static int ra_stop(struct sanctx *ctx, int resync) { return 0; }
+static void ra_free(struct sanctx *ctx) {}
+static struct sanraslot *ra_get(struct sanctx *ctx) { return NULL; }
+static void ra_put(struct sanctx *ctx) {}
 
-static void handle_NPAL(struct sanctx *ctx, uint32_t size, uint8_t *src)
+#endif	/* SANDEC_NO_THREADS */
+
+static void sandec_free_memories(struct sanctx *ctx)
 {
-	read_palette(ctx, src);
+	/* stop and delete the FRME read-ahead */
+	ra_free(ctx);
+	ctx->radepth = 0;
+	/* delete existing FRME buffer */
+	if (ctx->rt.fcache)
+		free(ctx->rt.fcache);
+	/* delete work buffers */
+	if (ctx->rt.iactbuf)
+		free(ctx->rt.iactbuf);
+	/* delete an existing framebuffer */
+	if (ctx->rt.buf && ctx->rt.fbsize)
+		frames_drop_arena(ctx, ctx->rt.buf);
+	/* delete the FRME index */
+	if (ctx->rt.fidx)
+		free(ctx->rt.fidx);
+	/* delete the deferred audio buffer and the mixer */
+	if (ctx->rt.aq)
+		free(ctx->rt.aq);
+	mix_free(&ctx->rt);
+	fc_free(&ctx->fc);
+	memset(&ctx->rt, 0, sizeof(struct sanrt));
+	ctx->qf.vdata = NULL;
 }
 
-static inline uint8_t _u8clip(int a)
+/******************************************************************************/
+/* FRME index and seeking */
+
+/* set up the resume point of the index after the last indexed frame */
+static void fidx_set_next(struct sanrt *rt, struct sanfidx *fi)
 {
-	if (a > 255) return 255;
-	else if (a < 0) return 0;
-	else return a;
+	fi->ofs = rt->fpos;
+	fi->iactpos = rt->iactpos;
+	fi->iacthdr[0] = rt->iactbuf[0];
+	fi->iacthdr[1] = rt->iactbuf[1];
 }
 
-static int handle_XPAL(struct sanctx *ctx, uint32_t size, uint8_t *src)
+/* track the IACT packet reassembly state over the audio data of an IACT
+ * chunk in the file, without reading all of it.  Mirrors the packet
+ * splitting done in iact_audio_scaled().
+ */
+static int fidx_scan_iact(struct sanctx *ctx, struct sanfidx *fi,
+			  uint32_t ofs, uint32_t size)
 {
-	const uint16_t cmd = be16_to_cpu(*(uint16_t *)(src + 2));
-	uint32_t *pal = ctx->rt.palette;
-	int16_t *dp = ctx->rt.deltapal;
-	int i, j, t2[3];
-
-	src += 4;
+	uint16_t len;
 
-	/* cmd1: apply delta */
-	if (cmd == 1) {
-		for (i = 0; i < 768; i += 3) {
-			t2[0] = (*pal >>  0) & 0xff;
-			t2[1] = (*pal >>  8) & 0xff;
-			t2[2] = (*pal >> 16) & 0xff;
-			for (j = 0; j < 3; j++) {
-				int cl = (t2[j] * 129) + le16_to_cpu(*dp++);
-				t2[j] = _u8clip(cl / 128) & 0xff;
+	while (size > 0) {
+		if (fi->iactpos >= 2) {
+			len = (fi->iacthdr[0] << 8 | fi->iacthdr[1]) + 2 - fi->iactpos;
+			if (len > size) {
+				fi->iactpos += size;
+				size = 0;
+			} else {
+				ofs += len;
+				size -= len;
+				fi->iactpos = 0;
 			}
-			*pal++ = 0xff << 24 | t2[2] << 16 | t2[1] << 8 | t2[0];
+		} else {
+			if (seek_source(ctx, ofs))
+				return 62;
+			if (read_source(ctx, fi->iacthdr + fi->iactpos, 1))
+				return 62;
+			fi->iactpos++;
+			ofs++;
+			size--;
 		}
-	/* cmd0/2: read deltapal values/+new palette */
-	} else if (cmd == 0 || cmd == 2) {
-		memcpy(ctx->rt.deltapal, src, 768 * 2);
-		if (size > (768 * 2 + 4))	/* cmd 2 */
-			read_palette(ctx, src + (768 * 2));
-	} else {
-		return 13;		/*  unknown XPAL cmd */
 	}
 	return 0;
 }
 
-static void iact_audio_scaled(struct sanctx *ctx, uint32_t size, uint8_t *src)
+/* extend the FRME index up to and including frame "upto", by walking only
+ * the chunk headers in the file.
+ */
+static int fidx_scan(struct sanctx *ctx, uint32_t upto)
 {
-	uint8_t v1, v2, v3, *src2, *ib = ctx->rt.iactbuf;
-	uint16_t count, len;
-	int16_t *dst;
+	struct sanrt *rt = &ctx->rt;
+	uint32_t c[2], b[8], ofs, left, csz;
+	struct sanfidx *fi;
+	uint16_t *p;
+	int ret;
 
-	/* algorithm taken from ScummVM/engines/scumm/smush/smush_player.cpp */
-	while (size > 0) {
-		if (ctx->rt.iactpos >= 2) {
-			len = be16_to_cpu(*(uint16_t *)ib) + 2 - ctx->rt.iactpos;
-			if (len > size) {  /* continued in next IACT chunk. */
-				memcpy(ib + ctx->rt.iactpos, src, size);
-				ctx->rt.iactpos += size;
-				size = 0;
-			} else {
-				memcpy(ib + ctx->rt.iactpos, src, len);
-				dst = (int16_t *)ctx->rt.abuf;
-				src2 = ib + 2;
-				v1 = *src2++;
-				v2 = v1 >> 4;
-				v1 &= 0x0f;
-				count = 1024 * 2;
-				do {
-					v3 = *src2++;
-					if (v3 == 0x80) {
-						*dst++ = cpu_to_le16(src2[0] << 8 | src2[1]);
-						src2 += 2;
-					} else {
-						*dst++ = cpu_to_le16((int8_t)v3) << ((count & 1) ? v1 : v2);
-					}
-				} while (--count);
-				ctx->io->queue_audio(ctx->io->userctx, ctx->rt.abuf, SZ_AUDIOOUT);
-				size -= len;
-				src += len;
-				ctx->rt.iactpos = 0;
+	while (rt->fidxcnt <= upto) {
+		fi = &rt->fidx[rt->fidxcnt];
+		if (seek_source(ctx, fi->ofs) || read_source(ctx, c, 8))
+			return 62;
+		if (c[0] != FRME)
+			return 4;
+		fi->size = be32_to_cpu(c[1]);
+		fi->codec = 0;
+		fi->flags = 0;
+		fi[1].iactpos = fi->iactpos;
+		fi[1].iacthdr[0] = fi->iacthdr[0];
+		fi[1].iacthdr[1] = fi->iacthdr[1];
+
+		ofs = fi->ofs + 8;
+		left = fi->size;
+		while (left > 7) {
+			if (seek_source(ctx, ofs) || read_source(ctx, c, 8))
+				return 62;
+			csz = be32_to_cpu(c[1]);
+			ofs += 8;
+			left -= 8;
+			if (csz > left)
+				return 17;
+
+			if (c[0] == FOBJ || c[0] == IACT) {
+				if (read_source(ctx, b, csz < 32 ? csz : 32))
+					return 62;
 			}
-		} else {
-			if (size > 1 && ctx->rt.iactpos == 0) {
-				*ib = *src++;
-				ctx->rt.iactpos++;
-				size--;
+			fidx_chunk(fi, c[0], csz, (uint8_t *)b);
+
+			p = (uint16_t *)b;
+			if (c[0] == IACT && csz > 18
+			    && p[0] == 8 && p[1] == 46 && p[3] == 0) {
+				ret = fidx_scan_iact(ctx, fi + 1, ofs + 18, csz - 18);
+				if (ret)
+					return ret;
 			}
-			*(ib + ctx->rt.iactpos) = *src++;
-			ctx->rt.iactpos++;
-			size--;
+
+			if (csz & 1)
+				csz += 1;
+			if (csz > left)
+				break;
+			ofs += csz;
+			left -= csz;
 		}
+		fi[1].ofs = fi->ofs + 8 + fi->size;
+		rt->fidxcnt++;
 	}
+	return 0;
 }
 
-static void handle_IACT(struct sanctx *ctx, uint32_t size, uint8_t *src)
+/* re-read and process the palette chunks, or the FOBJs carrying a codec47/48
+ * interpolation table, of the indexed frame f.
+ */
+static int fidx_replay_frame(struct sanctx *ctx, uint32_t f, int itbl)
 {
-	uint16_t *p = (uint16_t *)src;
+	struct sanrt *rt = &ctx->rt;
+	uint32_t c[2], ofs, left, csz;
+	uint8_t *src;
+	int ret = 0;
+
+	ofs = rt->fidx[f].ofs + 8;
+	left = rt->fidx[f].size;
+	while ((left > 7) && (ret == 0)) {
+		if (seek_source(ctx, ofs) || read_source(ctx, c, 8))
+			return 62;
+		csz = be32_to_cpu(c[1]);
+		ofs += 8;
+		left -= 8;
+		if (csz > left)
+			return 17;
 
-	if (p[0] == 8 && p[1] == 46) {
-		if (p[3] == 0) {
-			/* subchunkless scaled IACT audio codec47/48 videos */
-			iact_audio_scaled(ctx, size - 18, src + 18);
+		if ((itbl && c[0] == FOBJ) || (!itbl && (c[0] == NPAL || c[0] == XPAL))) {
+			ret = map_source(ctx, csz, &src);
+			if (ret)
+				return ret;
+
+			switch (c[0]) {
+			case NPAL: handle_NPAL(ctx, csz, src); break;
+			case XPAL: ret = handle_XPAL(ctx, csz, src); break;
+			case FOBJ:
+				if (src[0] == 47 && csz >= 14 + 26 + 0x8080 && (src[14 + 4] & 1))
+					codec47_itable(ctx, src + 14 + 26);
+				else if (src[0] == 48 && csz >= 14 + 16 + 0x8080 && (src[14 + 12] & 8))
+					codec47_itable(ctx, src + 14 + 16);
+				break;
+			}
 		}
+
+		if (csz & 1)
+			csz += 1;
+		if (csz > left)
+			break;
+		ofs += csz;
+		left -= csz;
 	}
+	return ret;
 }
 
-/* subtitles: index of message in the Outlaws LOCAL.MSG file, 10000 - 12001.
- * As long as subid is set to non-zero, the subtitle needs to be overlaid
- * over the image.  The chunk also provides hints about where to place
- * the subtitle, which we ignore here.
+/* restore the palette and interpolation table state at the start of frame
+ * k by replaying the relevant chunks of all frames before it.
  */
-static void handle_TRES(struct sanctx *ctx, uint32_t size, uint8_t *src)
+static int fidx_replay(struct sanctx *ctx, uint32_t k)
 {
-	uint16_t *tres = (uint16_t *)src;
-	ctx->rt.subid = size >= 10 ? le16_to_cpu(tres[8]) : 0;
+	struct sanrt *rt = &ctx->rt;
+	int ret, itf = -1;
+	uint32_t f;
+
+	memcpy(rt->palette, rt->ahdrpal, SZ_PAL);
+	memset(rt->deltapal, 0, SZ_DELTAPAL);
+	ctx->palgen++;
+	rt->have_itable = 0;
+
+	for (f = 0; f < k; f++) {
+		if (rt->fidx[f].flags & FIDX_ITBL)
+			itf = f;
+		if (rt->fidx[f].flags & (FIDX_NPAL | FIDX_XPAL)) {
+			ret = fidx_replay_frame(ctx, f, 0);
+			if (ret)
+				return ret;
+		}
+	}
+	if (itf >= 0)
+		return fidx_replay_frame(ctx, itf, 1);
+
+	return 0;
 }
 
-static void handle_STOR(struct sanctx *ctx, uint32_t size, uint8_t *src)
+/* find the nearest keyframe at or before frame f */
+static uint32_t fidx_prevkey(struct sanrt *rt, uint32_t f)
 {
-	ctx->rt.to_store = 1;
+	while (f > 0 && !(rt->fidx[f].flags & FIDX_KEY))
+		f--;
+	return f;
 }
 
-static void handle_FTCH(struct sanctx *ctx, uint32_t size, uint8_t *src)
+/* find the last STOR before frame f, or -1 */
+static int fidx_prevstor(struct sanrt *rt, uint32_t f)
 {
-	int32_t xoff, yoff, rx, ry;
-	uint8_t *db, *dst;
-	int i, j;
+	while (f-- > 0)
+		if (rt->fidx[f].flags & FIDX_STOR)
+			return f;
+	return -1;
+}
 
-	if (size != 12) {
-		xoff = *(int16_t *)(src + 2);
-		yoff = *(int16_t *)(src + 4);
+/* read and decode the next FRME, and add it to the index if it's new */
+static int read_frame(struct sanctx *ctx)
+{
+	struct sanrt *rt = &ctx->rt;
+	struct sanfidx *fi = NULL;
+	struct sanraslot *sl = NULL;
+	uint32_t c[2];
+	uint8_t *src;
+	int ret;
+
+	if (ctx->radepth && !rt->mem)
+		ra_start(ctx);
+
+	if (ctx->ra && ctx->ra->running) {
+		ST_TIME(ctx, SANDEC_ST_READ, sl = ra_get(ctx));
+		ret = sl->err;
+		c[1] = sl->size;
+		src = sl->buf;
+		if (ret == 0)
+			rt->fpos = sl->ofs + 8 + sl->size;
+		else if (ret == 1 && rt->currframe == rt->FRMEcnt)
+			ret = SANDEC_DONE;	/* seems we reached file end */
+		if (ret)
+			return ret;
 	} else {
-		xoff = be32_to_cpu(ua32(src + 4));
-		yoff = be32_to_cpu(ua32(src + 8));
+		ret = read_source(ctx, c, 8);
+		if (ret) {
+			if (rt->currframe == rt->FRMEcnt)
+				ret = SANDEC_DONE;	/* seems we reached file end */
+			return ret;
+		}
+
+		c[1] = be32_to_cpu(c[1]);
+		if (c[0] != FRME)
+			return 4;
+
+		ST_TIME(ctx, SANDEC_ST_READ, ret = map_source(ctx, c[1], &src));
+		if (ret)
+			return ret;
 	}
 
-	if (ctx->rt.buf0) {
-		if (xoff == 0 && yoff == 0)
-			memcpy(ctx->rt.buf0, ctx->rt.buf3, ctx->rt.fbsize);
-		else {
-			db = ctx->rt.buf3;
-			dst = ctx->rt.buf0;
-			for (i = 0; i < ctx->rt.bufh; i++) {
-				ry = (yoff + i) * ctx->rt.pitch;
-				if (ry < 0 || ry > ctx->rt.bufh)
-					continue;
-				for (j = 0; j < ctx->rt.bufw; j++) {
-					rx = xoff + j;
-					if (rx < 0 || rx > ctx->rt.bufw)
-						continue;
-					*(dst + ry + rx) = *(db + i * ctx->rt.pitch + j);
-				}
-			}
-		}
-		ctx->rt.have_frame = 1;
+	ST_COUNT(ctx, frme, 1);
+	ST_COUNT(ctx, bytes, c[1] + 8);
+
+	if (rt->fidx && rt->currframe == rt->fidxcnt && rt->fidxcnt < rt->FRMEcnt) {
+		fi = &rt->fidx[rt->fidxcnt];
+		fi->size = c[1];
+		fi->codec = 0;
+		fi->flags = 0;
+	}
+
+	ret = handle_FRME(ctx, c[1], src, fi);
+	if (sl)
+		ra_put(ctx);
+	if (ret == 0 && fi) {
+		rt->fidxcnt++;
+		fidx_set_next(rt, fi + 1);
 	}
+	return ret;
 }
 
-static int handle_FRME(struct sanctx *ctx, uint32_t size)
+/* seek the decoder to frame, see sandec_seek() */
+static int seek_frame(struct sanctx *ctx, int frame)
 {
 	struct sanrt *rt = &ctx->rt;
-	uint32_t cid, csz;
-	uint8_t *src;
-	int ret;
+	struct sanfidx *fidx;
+	int ret, k, f, s;
 
-	ret = allocfrme(ctx, size);
+	ret = ra_stop(ctx, 1);
 	if (ret)
-		return ret;
+		goto out;
 
-	src = rt->fcache;
-	if (read_source(ctx, src, size))
-		return 10;
+	ret = fidx_scan(ctx, frame);
+	if (ret)
+		goto out;
+	fidx = rt->fidx;
 
-	ret = 0;
-	while ((size > 7) && (ret == 0)) {
-		cid = le32_to_cpu(ua32(src + 0));
-		csz = be32_to_cpu(ua32(src + 4));
+	/* start at the closest keyframe, or earlier if a FTCH from there on
+	 * needs the image of a STOR before it.
+	 */
+	k = fidx_prevkey(rt, frame);
+	s = fidx_prevstor(rt, k);
+	while (s >= 0) {
+		for (f = s + 1; f < rt->FRMEcnt; f++) {
+			/* no need to know about frames which aren't there */
+			if (fidx_scan(ctx, f))
+				f = rt->FRMEcnt;
+			else if (fidx[f].flags & FIDX_FTCH)
+				break;
+			else if (fidx[f].flags & FIDX_STOR)
+				f = rt->FRMEcnt;
+		}
+		if (f >= rt->FRMEcnt)
+			break;
+		k = fidx_prevkey(rt, s);
+		s = fidx_prevstor(rt, k);
+	}
 
-		src += 8;
-		size -= 8;
+	/* no keyframe to start from: start over with clean buffers */
+	if (!(fidx[k].flags & FIDX_KEY) && rt->buf) {
+		if (ctx->fheld)
+			frames_detach(ctx, NULL);
+		memset(rt->buf, 0, rt->bufsize);
+		buf_reset(rt);
+		rt->lastseq = 0;
+	}
 
-		if (csz > size)
-			return 17;
+	ret = fidx_replay(ctx, k);
+	if (ret)
+		goto out;
 
-		switch (cid)
-		{
-		case NPAL: handle_NPAL(ctx, csz, src); break;
-		case FOBJ: ret = handle_FOBJ(ctx, csz, src); break;
-		case IACT: handle_IACT(ctx, csz, src); break;
-		case TRES: handle_TRES(ctx, csz, src); break;
-		case STOR: handle_STOR(ctx, csz, src); break;
-		case FTCH: handle_FTCH(ctx, csz, src); break;
-		case XPAL: ret = handle_XPAL(ctx, csz, src); break;
-		default:   ret = 0;     /* unknown chunk, ignore */
+	if (seek_source(ctx, fidx[k].ofs)) {
+		ret = 62;
+		goto out;
+	}
+	rt->currframe = k;
+	rt->iactpos = fidx[k].iactpos;
+	rt->iactbuf[0] = fidx[k].iacthdr[0];
+	rt->iactbuf[1] = fidx[k].iacthdr[1];
+	rt->iactdrop = (rt->iactpos != 0);
+	rt->have_ipframe = 0;
+	rt->can_ipol = 0;
+	rt->have_frame = 0;
+	rt->to_store = 0;
+	rt->subid = 0;
+	rt->dskip = 0;
+	rt->lastout = NULL;
+	rt->c37ref = NULL;
+	ctx->qf.vdata = NULL;
+	/* tracks begun before the keyframe are lost, the others are
+	 * fed and drained silently up to the target.
+	 */
+	mix_reset(rt);
+
+	/* decode up to the requested frame without any output */
+	rt->quiet = 1;
+	while (ret == 0 && rt->currframe < frame)
+		ret = read_frame(ctx);
+	rt->quiet = 0;
+
+	/* last decoded frame is the next interpolation source */
+	if (ret == 0 && rt->vbuf && rt->have_itable)
+		rt->ipref = rt->vbuf;
+
+out:
+	ctx->errdone = ret;
+	return ret;
+}
+
+/******************************************************************************/
+/* decoder state snapshots */
+
+/* the parts of the decoder state in a snapshot, in this order.  The images
+ * are stored by their role, buf0-3, since the codecs swap the buffers.
+ * Returns the number of parts.
+ */
+static int snap_parts(struct sanrt *rt, uint8_t **p, uint32_t *len,
+		      int itable, uint32_t iactpos, uint32_t fbsize)
+{
+	int n = 0;
+
+	p[n] = (uint8_t *)rt->palette;	len[n++] = SZ_PAL;
+	p[n] = (uint8_t *)rt->deltapal;	len[n++] = SZ_DELTAPAL;
+	p[n] = rt->c47ipoltbl;		len[n++] = itable ? SZ_C47IPTBL : 0;
+	p[n] = rt->iactbuf;		len[n++] = iactpos;
+	p[n] = rt->buf0;		len[n++] = fbsize;
+	p[n] = rt->buf1;		len[n++] = fbsize;
+	p[n] = rt->buf2;		len[n++] = fbsize;
+	p[n] = rt->buf3;		len[n++] = fbsize;
+	return n;
+}
+
+/* role of an image pointer for a snapshot */
+static uint8_t snap_bufidx(struct sanrt *rt, uint8_t *b)
+{
+	if (!b)
+		return SSNP_NOBUF;
+	if (b == rt->buf0)
+		return 0;
+	if (b == rt->buf1)
+		return 1;
+	if (b == rt->buf2)
+		return 2;
+	if (b == rt->buf3)
+		return 3;
+	return SSNP_NOBUF;
+}
+
+static uint8_t *snap_buf(struct sanrt *rt, uint8_t idx)
+{
+	switch (idx) {
+	case 0:  return rt->buf0;
+	case 1:  return rt->buf1;
+	case 2:  return rt->buf2;
+	case 3:  return rt->buf3;
+	default: return NULL;
+	}
+}
+
+/******************************************************************************/
+/* public interface */
+
+int sandec_decode_next_frame(void *sanctx)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+	int ret;
+
+	if (!ctx)
+		return 1;
+	/* in case of previous error, don't continue, just return it again */
+	if (ctx->errdone)
+		return ctx->errdone;
+	ctx->qf.vdata = NULL;
+	ST_CLEAR(ctx);
+
+	/* frames from the cache, until the first one not in there */
+	if (ctx->fc.serve) {
+		struct sanfc *fc = &ctx->fc;
+		int ok;
+
+		ST_TIME(ctx, SANDEC_ST_FRAME, ok = fc_next(ctx));
+		if (ok)
+			return SANDEC_OK;
+		fc_leave(ctx);
+		if (fc->pos >= ctx->rt.FRMEcnt)
+			ret = SANDEC_DONE;
+		else if (fc->pos != ctx->rt.currframe || fc->err)
+			ret = sandec_seek(ctx, fc->pos);
+		else
+			ret = 0;
+		if (ret) {
+			ctx->errdone = ret;
+			return ret;
 		}
-		/* all objects in the SAN stream are padded so their length
-		 * is even. */
-		if (csz & 1)
-			csz += 1;
-		src += csz;
-		size -= csz;
 	}
 
-	/* OK case: all usable bytes of the FRME read, no errors */
-	if (ret == 0) {
-		if (ctx->rt.have_frame) {
-			if (rt->to_store)	/* STOR */
-				memcpy(rt->buf3, rt->vbuf, rt->fbsize);
+	/* interpolated frame: was queued first, now queue the decoded one */
+	if (ctx->rt.have_ipframe) {
+		struct sanrt *rt = &ctx->rt;
+		rt->have_ipframe = 0;
+		ST_TIME(ctx, SANDEC_ST_FRAME,
+			queue_image(ctx, rt->vbuf, rt->framedur / 2, rt->ipol_same));
+		return SANDEC_OK;
+	}
+
+	ST_TIME(ctx, SANDEC_ST_FRAME, ret = read_frame(ctx));
+	ctx->errdone = ret;
+	return ret;
+}
+
+int sandec_seek(void *sanctx, int frame)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+	struct sanrt *rt;
+
+	if (!ctx || !ctx->io)
+		return 1;
+	rt = &ctx->rt;
+	if (!can_seek(ctx) || !rt->fidx)
+		return 60;
+	if (frame < 0 || frame >= rt->FRMEcnt)
+		return 61;
+
+	/* served from the frame cache, the decoder stays where it is */
+	if (fc_seek(ctx, frame))
+		return 0;
+	fc_leave(ctx);
+
+	return seek_frame(ctx, frame);
+}
+
+int sandec_index_export(void *sanctx, void *buf, uint32_t *size)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+	uint32_t i, n, fpos, maxsz, need;
+	struct sanfidx *fi;
+	struct sanrt *rt;
+	uint8_t *p;
+
+	if (!ctx || !size)
+		return 1;
+	rt = &ctx->rt;
+	if (!rt->fidx)
+		return 60;
+
+	/* complete the index if possible, a partial one is fine too */
+	if (rt->fidxcnt < rt->FRMEcnt && can_seek(ctx)) {
+		if (ra_stop(ctx, 1)) {
+			ctx->errdone = 70;
+			return 70;
+		}
+		fpos = rt->fpos;
+		fidx_scan(ctx, rt->FRMEcnt - 1);
+		if (seek_source(ctx, fpos)) {
+			ctx->errdone = 62;
+			return 62;
+		}
+	}
+
+	n = rt->fidxcnt;
+	need = SIDX_HDRSZ + (n + 1) * SIDX_ENTSZ;
+	if (!buf) {
+		*size = need;
+		return 0;
+	}
+	if (*size < need)
+		return 64;
+
+	p = (uint8_t *)buf + SIDX_HDRSZ;
+	maxsz = 0;
+	for (i = 0, fi = rt->fidx; i <= n; i++, fi++, p += SIDX_ENTSZ) {
+		wr32le(p + 0, fi->ofs);
+		wr32le(p + 4, fi->size);
+		wr16le(p + 8, fi->iactpos);
+		p[10] = fi->iacthdr[0];
+		p[11] = fi->iacthdr[1];
+		p[12] = fi->codec;
+		p[13] = fi->flags;
+		if (i < n)
+			maxsz = _max(maxsz, fi->size);
+	}
+
+	p = (uint8_t *)buf;
+	wr32le(p + 0, SIDX_MAGIC);
+	wr16le(p + 4, SIDX_VERSION);
+	wr16le(p + 6, SIDX_ENTSZ);
+	wr32le(p + 8, rt->animsize);
+	wr32le(p + 12, rt->ahdrhash);
+	wr32le(p + 16, rt->FRMEcnt);
+	wr32le(p + 20, n);
+	wr32le(p + 24, maxsz);
+	wr32le(p + 28, fnv1a(p + SIDX_HDRSZ, need - SIDX_HDRSZ, 2166136261U));
+	*size = need;
+
+	return 0;
+}
+
+int sandec_index_import(void *sanctx, const void *buf, uint32_t size)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+	uint8_t *p = (uint8_t *)buf;
+	uint32_t i, n, ofs, sz, maxsz;
+	struct sanfidx *fi;
+	struct sanrt *rt;
 
-			/* if possible, interpolate a frame using the itable,
-			 * and queue that plus the decoded one.
-			 */
-			if (ctx->io->flags & SANDEC_FLAG_DO_FRAME_INTERPOLATION
-			    && rt->have_itable
-			    && rt->can_ipol) {
-				interpolate_frame(rt->buf5, rt->buf4, rt->vbuf,
-						  rt->c47ipoltbl, rt->bufw, rt->bufh);
-				rt->have_ipframe = 1;
-				rt->can_ipol = 0;
-				memcpy(rt->buf4, rt->vbuf, rt->fbsize);
-				ctx->io->queue_video(ctx->io->userctx, rt->buf5, rt->fbsize,
-					     rt->frmw, rt->frmh, rt->palette,
-					     rt->subid, rt->framedur / 2);
-			} else {
-				ctx->io->queue_video(ctx->io->userctx, rt->vbuf, rt->fbsize,
-					     rt->frmw, rt->frmh, rt->palette,
-					     rt->subid, rt->framedur);
-				/* save frame as possible interpolation source */
-				if (rt->have_itable)
-					memcpy(rt->buf4, rt->vbuf, rt->fbsize);
-			}
+	if (!ctx || !buf)
+		return 1;
+	rt = &ctx->rt;
+	if (!rt->fidx)
+		return 60;
+
+	/* check that the sidecar is intact and belongs to this file */
+	if (size < SIDX_HDRSZ
+	    || le32_to_cpu(ua32(p + 0)) != SIDX_MAGIC
+	    || le16_to_cpu(ua16(p + 4)) != SIDX_VERSION
+	    || le16_to_cpu(ua16(p + 6)) != SIDX_ENTSZ)
+		return 65;
+	n = le32_to_cpu(ua32(p + 20));
+	if (le32_to_cpu(ua32(p + 8)) != rt->animsize
+	    || le32_to_cpu(ua32(p + 12)) != rt->ahdrhash
+	    || le32_to_cpu(ua32(p + 16)) != rt->FRMEcnt
+	    || n > rt->FRMEcnt
+	    || size < SIDX_HDRSZ + (n + 1) * SIDX_ENTSZ
+	    || le32_to_cpu(ua32(p + 28)) != fnv1a(p + SIDX_HDRSZ, (n + 1) * SIDX_ENTSZ, 2166136261U))
+		return 66;
+
+	/* the index we already have can only be a subset */
+	if (n <= rt->fidxcnt)
+		return 0;
+
+	p += SIDX_HDRSZ;
+	ofs = rt->fidx[0].ofs;
+	maxsz = 0;
+	for (i = 0; i <= n; i++, p += SIDX_ENTSZ) {
+		if (le32_to_cpu(ua32(p + 0)) != ofs)
+			return 66;
+		if (i < n) {
+			sz = le32_to_cpu(ua32(p + 4));
+			ofs += 8 + sz;
+			maxsz = _max(maxsz, sz);
 		}
+	}
 
-		rt->to_store = 0;
-		rt->currframe++;
-		rt->subid = 0;
-		rt->have_frame = 0;
+	/* the largest FRME is known now, size the FRME cache for it, within
+	 * the same limit as the AHDR hint.
+	 */
+	if (!rt->mem && maxsz < 4 * 1024 * 1024 && allocfrme(ctx, maxsz))
+		return 1;
+
+	p = (uint8_t *)buf + SIDX_HDRSZ;
+	for (i = 0, fi = rt->fidx; i <= n; i++, fi++, p += SIDX_ENTSZ) {
+		fi->ofs = le32_to_cpu(ua32(p + 0));
+		fi->size = le32_to_cpu(ua32(p + 4));
+		fi->iactpos = le16_to_cpu(ua16(p + 8));
+		fi->iacthdr[0] = p[10];
+		fi->iacthdr[1] = p[11];
+		fi->codec = p[12];
+		fi->flags = p[13];
 	}
+	rt->fidxcnt = n;
 
-	return ret;
+	return 0;
 }
 
-static int handle_AHDR(struct sanctx *ctx, uint32_t size)
+int sandec_snapshot(void *sanctx, void *buf, uint32_t *size, int flags)
 {
-	struct sanrt *rt = &ctx->rt;
-	uint8_t *ahbuf, *xbuf = NULL;
-	uint32_t maxframe;
-	int ret = SANDEC_OK;
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+	uint32_t len[SSNP_PARTS], fbsize, need, n;
+	uint8_t *part[SSNP_PARTS], *p;
+	struct sanrt *rt;
+	int i, np, f, ret;
 
-	ahbuf = (uint8_t *)malloc(size);
-	if (!ahbuf)
-		return 5;
-	if (read_source(ctx, ahbuf, size)) {
-		ret = 6;
-		goto out;
+	if (!ctx || !size || !ctx->io)
+		return 1;
+	rt = &ctx->rt;
+	if (!rt->palette)
+		return 60;
+
+	/* frames from the cache: the decoder catches up to the next one */
+	if (ctx->fc.serve) {
+		f = ctx->fc.pos;
+		if (f != rt->currframe || ctx->fc.err) {
+			if (f >= rt->FRMEcnt || !can_seek(ctx))
+				return 61;
+			fc_leave(ctx);
+			ret = seek_frame(ctx, f);
+			if (ret)
+				return ret;
+		}
+		fc_leave(ctx);
 	}
 
-	rt->version = le16_to_cpu(*(uint16_t *)(ahbuf + 0));
-	rt->FRMEcnt = le16_to_cpu(*(uint16_t *)(ahbuf + 2));
+	fbsize = rt->buf ? rt->fbsize : 0;
+	np = snap_parts(rt, part, len, rt->have_itable,
+			_min(rt->iactpos, SZ_IACT), fbsize);
+	need = SSNP_HDRSZ;
+	for (i = 0; i < np; i++)
+		need += (flags & SANDEC_SNAP_RLE) ? RLE_BOUND(len[i]) : len[i];
+	if (!buf) {
+		*size = need;
+		return 0;
+	}
+	if (*size < need)
+		return 64;
 
-	/* allocate memory for static work buffers */
-	xbuf = malloc(SZ_ALL);
-	if (!xbuf) {
-		ret = 8;
-		goto out;
+	p = (uint8_t *)buf + SSNP_HDRSZ;
+	for (i = 0; i < np; i++) {
+		if (flags & SANDEC_SNAP_RLE) {
+			p += rle_pack(p, part[i], len[i]);
+		} else {
+			memcpy(p, part[i], len[i]);
+			p += len[i];
+		}
 	}
+	n = p - (uint8_t *)buf;
+
+	p = (uint8_t *)buf;
+	memset(p, 0, SSNP_HDRSZ);
+	wr32le(p + 0, SSNP_MAGIC);
+	wr16le(p + 4, SSNP_VERSION);
+	wr16le(p + 6, flags & SANDEC_SNAP_RLE);
+	wr32le(p + 8, rt->animsize);
+	wr32le(p + 12, rt->ahdrhash);
+	wr16le(p + 16, rt->FRMEcnt);
+	wr16le(p + 18, rt->currframe);
+	wr32le(p + 20, rt->fpos);
+	wr16le(p + 24, _min(rt->iactpos, SZ_IACT));
+	wr16le(p + 26, rt->lastseq);
+	wr16le(p + 28, rt->pitch);
+	wr16le(p + 30, rt->buf ? rt->bufw : 0);
+	wr16le(p + 32, rt->buf ? rt->bufh : 0);
+	wr16le(p + 34, rt->frmw);
+	wr16le(p + 36, rt->frmh);
+	p[38] = rt->have_itable;
+	p[39] = rt->iactdrop;
+	p[40] = snap_bufidx(rt, rt->vbuf);
+	p[41] = snap_bufidx(rt, rt->stor);
+	p[42] = snap_bufidx(rt, rt->b0src);
+	p[43] = snap_bufidx(rt, rt->c37ref);
+	wr32le(p + 44, n - SSNP_HDRSZ);
+	wr32le(p + 48, fnv1a(p + SSNP_HDRSZ, n - SSNP_HDRSZ, 2166136261U));
+	*size = n;
 
-	rt->iactbuf = (uint8_t *)xbuf;
-	rt->palette = (uint32_t *)((uint8_t *)(rt->iactbuf) + SZ_IACT);
-	rt->deltapal = (int16_t *)((uint8_t *)rt->palette + SZ_PAL);
-	rt->c47ipoltbl = (uint8_t *)rt->deltapal + SZ_DELTAPAL;
-	rt->abuf = (uint8_t *)rt->c47ipoltbl + SZ_C47IPTBL;
+	return 0;
+}
 
-	read_palette(ctx, ahbuf + 6);	/* 768 bytes */
+int sandec_restore(void *sanctx, const void *buf, uint32_t size)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+	uint32_t len[SSNP_PARTS], n, fbsize;
+	uint16_t w, h, iactpos, pitch, frmw, frmh;
+	uint8_t *part[SSNP_PARTS], *p = (uint8_t *)buf;
+	struct sanrt *rt;
+	int i, np, ret, rle;
 
-	if (rt->version > 1) {
-		rt->framedur  =  le32_to_cpu(*(uint32_t *)(ahbuf + 6 + 768 + 0));
-		rt->framedur = 1000000 / rt->framedur;
-		maxframe =       le32_to_cpu(*(uint32_t *)(ahbuf + 6 + 768 + 4));
-		rt->samplerate = le32_to_cpu(*(uint32_t *)(ahbuf + 6 + 768 + 8));
+	if (!ctx || !buf || !ctx->io)
+		return 1;
+	rt = &ctx->rt;
+	if (!can_seek(ctx) || !rt->palette)
+		return 60;
+
+	/* check that the snapshot is intact and belongs to this file */
+	if (size < SSNP_HDRSZ
+	    || le32_to_cpu(ua32(p + 0)) != SSNP_MAGIC
+	    || le16_to_cpu(ua16(p + 4)) != SSNP_VERSION
+	    || le32_to_cpu(ua32(p + 44)) != size - SSNP_HDRSZ
+	    || le32_to_cpu(ua32(p + 48)) != fnv1a(p + SSNP_HDRSZ, size - SSNP_HDRSZ, 2166136261U))
+		return 76;
+	w = le16_to_cpu(ua16(p + 30));
+	h = le16_to_cpu(ua16(p + 32));
+	iactpos = le16_to_cpu(ua16(p + 24));
+	pitch = le16_to_cpu(ua16(p + 28));
+	frmw = le16_to_cpu(ua16(p + 34));
+	frmh = le16_to_cpu(ua16(p + 36));
+	if (le32_to_cpu(ua32(p + 8)) != rt->animsize
+	    || le32_to_cpu(ua32(p + 12)) != rt->ahdrhash
+	    || le16_to_cpu(ua16(p + 16)) != rt->FRMEcnt
+	    || le16_to_cpu(ua16(p + 18)) > rt->FRMEcnt
+	    || iactpos > SZ_IACT || (w && (w < 2 || h < 2)))
+		return 77;
+	/* the images must fit the frame buffers */
+	if (pitch > w || frmw > w || frmh > h)
+		return 76;
+
+	fc_leave(ctx);
+	ret = ra_stop(ctx, 1);
+	if (ret)
+		goto out;
 
-		/* "maxframe" indicates the maximum size of one FRME object
-		 * including chunk ID and chunk size in the stream (usually the first)
-		 * plus 1 byte.
-		 */
-		if ((maxframe > 9) && (maxframe < 4 * 1024 * 1024)) {
-			ret = allocfrme(ctx, maxframe);
-		}
-	} else {
-		rt->framedur = 1000000 / 10;	/* ANIMv1 default */
-		rt->samplerate = 11025;		/* ANIMv1 default */
-		rt->frmebufsz = 0;
+	/* get frame buffers of the same size, or clear the ones we have */
+	if (w && (!rt->buf || rt->bufw != w || rt->bufh != h)) {
+		ret = fobj_alloc_buffers(ctx, w, h, 1, 1);
+		if (ret)
+			goto out;
+	} else if (rt->buf && ctx->fheld) {
+		frames_detach(ctx, NULL);
+	}
+	if (!w && rt->buf) {
+		memset(rt->buf, 0, rt->bufsize);
+		buf_reset(rt);
 	}
 
+	rle = le16_to_cpu(ua16(p + 6)) & SANDEC_SNAP_RLE;
+	fbsize = w ? rt->fbsize : 0;
+	np = snap_parts(rt, part, len, p[38], iactpos, fbsize);
+	p += SSNP_HDRSZ;
+	size -= SSNP_HDRSZ;
+	for (i = 0; i < np; i++) {
+		if (rle) {
+			ret = rle_unpack(part[i], len[i], p, size);
+			n = ret;
+		} else {
+			ret = (len[i] > size) ? -1 : 0;
+			n = len[i];
+			if (ret == 0)
+				memcpy(part[i], p, n);
+		}
+		if (ret < 0) {
+			/* the state is gone already */
+			ret = 76;
+			goto out;
+		}
+		p += n;
+		size -= n;
+	}
+	p = (uint8_t *)buf;
+
+	rt->currframe = le16_to_cpu(ua16(p + 18));
+	rt->fpos = le32_to_cpu(ua32(p + 20));
+	rt->iactpos = iactpos;
+	rt->iactdrop = p[39];
+	rt->lastseq = (int16_t)le16_to_cpu(ua16(p + 26));
+	rt->pitch = pitch;
+	rt->frmw = frmw;
+	rt->frmh = frmh;
+	rt->have_itable = !!p[38];
+	rt->vbuf = snap_buf(rt, p[40]);
+	rt->stor = snap_buf(rt, p[41]);
+	if (!rt->stor)
+		rt->stor = rt->buf3;
+	rt->b0src = snap_buf(rt, p[42]);
+	rt->c37ref = snap_buf(rt, p[43]);
+	ctx->palgen++;
+
+	/* like after a seek: the last image is the interpolation source */
+	rt->ipref = (rt->vbuf && rt->have_itable) ? rt->vbuf : rt->buf4;
+	rt->have_ipframe = 0;
+	rt->can_ipol = 0;
+	rt->have_frame = 0;
+	rt->to_store = 0;
+	rt->subid = 0;
+	rt->dskip = 0;
+	rt->lastout = NULL;
+	rt->dmapref = NULL;
+	rt->cmapref = NULL;
+	ctx->qf.vdata = NULL;
+	mix_reset(rt);
+
+	if (seek_source(ctx, rt->fpos))
+		ret = 62;
+	else
+		ret = 0;
 out:
-	if ((ret != SANDEC_OK) && xbuf)
-		free(xbuf);
+	ctx->errdone = ret;
+	return ret;
+}
 
-	free(ahbuf);
+int sandec_readahead(void *sanctx, int depth)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+	int ret = 0;
+
+	if (!ctx || depth < 0 || depth > 256)
+		return 1;
+#ifdef SANDEC_NO_THREADS
+	return depth ? 71 : ret;
+#else
+	/* restarts with the new depth on the next FRME */
+	ret = ra_stop(ctx, 1);
+	ra_free(ctx);
+	ctx->radepth = depth;
+	if (ret)
+		ctx->errdone = ret;
 	return ret;
+#endif
 }
 
-static void sandec_free_memories(struct sanctx *ctx)
+int sandec_threads(void *sanctx, int nthreads)
 {
-	/* delete existing FRME buffer */
-	if (ctx->rt.fcache)
-		free(ctx->rt.fcache);
-	/* delete work buffers */
-	if (ctx->rt.iactbuf)
-		free(ctx->rt.iactbuf);
-	/* delete an existing framebuffer */
-	if (ctx->rt.buf && ctx->rt.fbsize)
-		free(ctx->rt.buf);
-	memset(&ctx->rt, 0, sizeof(struct sanrt));
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+
+	if (!ctx || nthreads < 0 || nthreads > SANDEC_MAXTHREADS)
+		return 1;
+#ifdef SANDEC_NO_THREADS
+	return nthreads ? 71 : 0;
+#else
+	pool_free(ctx);
+	return nthreads ? pool_init(ctx, nthreads) : 0;
+#endif
 }
 
-/******************************************************************************/
-/* public interface */
+int sandec_decimate(void *sanctx, int n)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
 
-int sandec_decode_next_frame(void *sanctx)
+	if (!ctx || n < 1 || n > 65535)
+		return 1;
+	ctx->decim = n;
+	ctx->rt.dskip = 0;
+	return 0;
+}
+
+int sandec_frame_cache(void *sanctx, uint32_t budget)
 {
 	struct sanctx *ctx = (struct sanctx *)sanctx;
-	uint32_t c[2];
-	int ret;
 
 	if (!ctx)
 		return 1;
-	/* in case of previous error, don't continue, just return it again */
-	if (ctx->errdone)
-		return ctx->errdone;
+	ctx->fc.budget = budget;
+	if (ctx->fc.idx)
+		fc_trim(&ctx->fc, budget);
+	return 0;
+}
 
-	/* interpolated frame: was queued first, now queue the decoded one */
-	if (ctx->rt.have_ipframe) {
-		struct sanrt *rt = &ctx->rt;
-		rt->have_ipframe = 0;
-		ctx->io->queue_video(ctx->io->userctx, rt->vbuf, rt->fbsize,
-				     rt->frmw, rt->frmh, rt->palette,
-				     rt->subid, rt->framedur / 2);
-		return SANDEC_OK;
+int sandec_frame_pool(void *sanctx, int count)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+
+	if (!ctx || count < 0 || count > SANDEC_MAXFRAMES)
+		return 1;
+	/* the pool is part of the frame buffer allocation */
+	if (ctx->rt.buf && count != ctx->rt.nfpool)
+		return 73;
+	ctx->nframes = count;
+	return 0;
+}
+
+int sandec_output(void *sanctx, int format, void *buf, uint32_t size)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+	struct sanrt *rt;
+	int bpp;
+
+	if (!ctx || format < SANDEC_FMT_INDEX8 || format > SANDEC_FMT_NV12)
+		return 1;
+	rt = &ctx->rt;
+	bpp = fmt_bpp(format);
+	if (format == SANDEC_FMT_INDEX8)
+		buf = NULL;
+	if (bpp && ((uintptr_t)buf) & (bpp - 1))
+		return 1;
+	if (rt->buf) {
+		/* the pool and own buffer are sized for the format */
+		if (fmt_size(format, rt->bufw, rt->bufh) != rt->osize
+		    || (!buf && ctx->obufu))
+			return 73;
+		if (buf && size < rt->osize)
+			return 74;
 	}
+	ctx->ofmt = format;
+	ctx->obufu = (uint8_t *)buf;
+	ctx->obufusz = size;
+	rt->olast = NULL;	/* convert all of the next image */
+	return 0;
+}
 
-	ret = read_source(ctx, c, 8);
-	if (ret) {
-		if (ctx->rt.currframe == ctx->rt.FRMEcnt)
-			ret = SANDEC_DONE;	/* seems we reached file end */
-		goto out;
+const uint32_t *sandec_get_palette(void *sanctx, int format, uint32_t *generation)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+
+	if (!ctx || !ctx->rt.palette || format < SANDEC_FMT_INDEX8
+	    || format > SANDEC_FMT_NV12)
+		return NULL;
+	if (generation)
+		*generation = ctx->palgen;
+	return pal_derive(ctx, format);
+}
+
+struct sanframe *sandec_frame_hold(void *sanctx)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+	struct sanrt *rt;
+	struct sanfslot *fs;
+	int i;
+
+	if (!ctx || !ctx->qf.vdata)
+		return NULL;
+	rt = &ctx->rt;
+
+	if (ctx->qslot >= 0) {
+		fs = &ctx->fslot[ctx->qslot];
+		fs->refs++;
+		return &fs->f;
 	}
 
-	c[1] = be32_to_cpu(c[1]);
-	switch (c[0]) {
-	case FRME: 	ret = handle_FRME(ctx, c[1]); break;
-	default:	ret = 4;
+	for (i = 0; i < rt->nfpool; i++) {
+		if (!ctx->fslot[i].refs)
+			break;
 	}
+	if (i >= rt->nfpool)
+		return NULL;
+
+	fs = &ctx->fslot[i];
+	fs->f = ctx->qf;
+	fs->img = rt->fpool + (i * fs->f.size);
+	fs->arena = rt->buf;
+	memcpy(fs->pal, rt->palette, 256 * sizeof(uint32_t));
+	fs->f.pal = fs->pal;
+	fs->refs = 1;
+	ctx->qslot = i;
+	ctx->fheld++;
+
+	return &fs->f;
+}
 
-out:
-	ctx->errdone = ret;
-	return ret;
+void sandec_frame_release(void *sanctx, struct sanframe *frame)
+{
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+	struct sanfslot *fs = (struct sanfslot *)frame;
+	int i;
+
+	if (!ctx || !fs || !fs->refs)
+		return;
+	if (--fs->refs)
+		return;
+	ctx->fheld--;
+	if (ctx->qslot == fs - ctx->fslot)
+		ctx->qslot = -1;
+
+	/* last frame in an old frame buffer allocation */
+	if (fs->arena == ctx->rt.buf)
+		return;
+	for (i = 0; i < SANDEC_MAXFRAMES; i++) {
+		if (ctx->fslot[i].refs && ctx->fslot[i].arena == fs->arena)
+			return;
+	}
+	for (i = 0; i < SANDEC_MAXFRAMES; i++) {
+		if (ctx->fold[i] == fs->arena) {
+			free(ctx->fold[i]);
+			ctx->fold[i] = NULL;
+		}
+	}
+}
+
+int sandec_get_stats(void *sanctx, struct sanstats *st)
+{
+#ifdef SANDEC_STATS
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+
+	if (!ctx || !st)
+		return 1;
+	memcpy(st, &ctx->st, sizeof(struct sanstats));
+	return 0;
+#else
+	return SANDEC_ERR_NOSTATS;
+#endif
+}
+
+int sandec_trace(void *sanctx, void (*fn)(void *userctx, int stage,
+					   uint64_t start, uint64_t ns))
+{
+#ifdef SANDEC_STATS
+	struct sanctx *ctx = (struct sanctx *)sanctx;
+
+	if (!ctx)
+		return 1;
+	ctx->trace = fn;
+	return 0;
+#else
+	return SANDEC_ERR_NOSTATS;
+#endif
 }
 
 int sandec_init(void **ctxout)
@@ -1684,19 +5433,24 @@ int sandec_init(void **ctxout)
 	return 0;
 }
 
-int sandec_open(void *sanctx, struct sanio *io)
+static int open_source(struct sanctx *ctx, struct sanio *io,
+		       const uint8_t *mem, uint32_t memsize)
 {
-	struct sanctx *ctx = (struct sanctx *)sanctx;
 	int ret, have_anim = 0, have_ahdr = 0;
-	uint32_t c[2];
+	uint32_t c[2], f;
 
-	if (!io || !sanctx) {
+	if (!io || !ctx) {
 		ret = 1;
 		goto out;
 	}
 	ctx->io = io;
 
 	sandec_free_memories(ctx);
+	ctx->rt.mem = mem;
+	ctx->rt.memsize = memsize;
+#ifdef SANDEC_STATS
+	memset(&ctx->st, 0, sizeof(struct sanstats));
+#endif
 
 	while (1) {
 		ret = read_source(ctx, &c[0], 4 * 2);
@@ -1707,6 +5461,7 @@ int sandec_open(void *sanctx, struct sanio *io)
 		if (!have_anim) {
 			if (c[0] == ANIM) {
 				have_anim = 1;
+				ctx->rt.animsize = be32_to_cpu(c[1]);
 			}
 			continue;
 		}
@@ -1718,14 +5473,221 @@ int sandec_open(void *sanctx, struct sanio *io)
 
 	if (have_ahdr)
 		ret = handle_AHDR(ctx, be32_to_cpu(c[1]));
+
+	/* set up the FRME index, first FRME follows the AHDR.  Without memory
+	 * for it, seeking is just not available.
+	 */
+	if (ret == 0 && ctx->rt.FRMEcnt) {
+		f = (ctx->rt.FRMEcnt + 1) * sizeof(struct sanfidx);
+		ctx->rt.fidx = (struct sanfidx *)malloc(f);
+		if (ctx->rt.fidx) {
+			memset(ctx->rt.fidx, 0, f);
+			ctx->rt.fidx[0].ofs = ctx->rt.fpos;
+		}
+	}
 out:
-	ctx->errdone = ret;
+	if (ctx)
+		ctx->errdone = ret;
 	return ret;
 }
 
+/* header reader of sandec_probe(), without a decoder context */
+struct sanprb {
+	struct sanio *io;
+	uint32_t pos;		/* 4 current file offset		*/
+	uint8_t t[256];		/* chunk header buffer			*/
+};
+
+static int prb_read(struct sanprb *pb, void *dst, uint32_t sz)
+{
+	pb->pos += sz;
+	return !(pb->io->ioread(pb->io->userctx, dst, sz));
+}
+
+/* skip sz bytes; without ioseek() they are read */
+static int prb_skip(struct sanprb *pb, uint32_t sz)
+{
+	uint32_t n;
+
+	if (!sz)
+		return 0;
+	if (pb->io->ioseek) {
+		pb->pos += sz;
+		return !(pb->io->ioseek(pb->io->userctx, pb->pos));
+	}
+	while (sz) {
+		n = _min(sz, sizeof(pb->t));
+		if (prb_read(pb, pb->t, n))
+			return 1;
+		sz -= n;
+	}
+	return 0;
+}
+
+/* image size and codec of an FOBJ header, like handle_FOBJ() sets up the
+ * buffers for it.
+ */
+static void prb_fobj(struct sanprobe *pr, uint8_t *src)
+{
+	int w, h, left, top, align, i;
+	uint8_t codec = src[0];
+
+	left = (int16_t)le16_to_cpu(ua16(src + 2));
+	top  = (int16_t)le16_to_cpu(ua16(src + 4));
+	w    = le16_to_cpu(ua16(src + 6));
+	h    = le16_to_cpu(ua16(src + 8));
+
+	align = (codec == 37) ? 4 : 2;
+	align = (codec == 48) ? 8 : align;
+	if (w < align || h < align)
+		return;
+	if (pr->version < 2 && (w < 320 || h < 200) && (top == 0) && left == 0) {
+		w = 320;
+		h = 200;
+	}
+	if (codec == 47 || codec == 48)
+		left = top = 0;
+	pr->w = _max(pr->w, _max(left + w, 0));
+	pr->h = _max(pr->h, _max(top + h, 0));
+
+	for (i = 0; i < pr->ncodec; i++)
+		if (pr->codec[i] == codec)
+			return;
+	if (pr->ncodec < SANDEC_PROBE_CODECS)
+		pr->codec[pr->ncodec++] = codec;
+}
+
+/* audio format of the first audio chunk, len bytes of it at src */
+static void prb_audio(struct sanprobe *pr, uint32_t cid, uint8_t *src,
+		      uint32_t len)
+{
+	uint32_t bits, chans, rate, sz;
+	uint8_t *h;
+
+	if (pr->audio != SANDEC_AUDIO_NONE)
+		return;
+	if (cid == IACT) {
+		if (len < 18 || le16_to_cpu(ua16(src)) != 8
+		    || le16_to_cpu(ua16(src + 2)) != 46)
+			return;
+		if (le16_to_cpu(ua16(src + 6)) == 0) {
+			pr->audio = SANDEC_AUDIO_IACT;
+			pr->abits = 16;
+			pr->achans = 2;
+			pr->arate = 22050;
+			return;
+		}
+		pr->audio = SANDEC_AUDIO_IMUSE;
+		rate = MIX_RATE;
+		h = src + 18;
+		len -= 18;
+	} else {
+		if (len < 10)
+			return;
+		pr->audio = SANDEC_AUDIO_PSAD;
+		rate = pr->samplerate ? pr->samplerate : MIX_RATE;
+		h = src + 10;
+		len -= 10;
+	}
+	/* the first packet of a track has the header */
+	if (le16_to_cpu(ua16(src + (cid == IACT ? 10 : 2))) == 0
+	    && track_format(h, len, &bits, &chans, &rate, &sz) > 0) {
+		pr->abits = bits;
+		pr->achans = chans;
+		pr->arate = rate;
+	}
+}
+
+int sandec_probe(struct sanio *io, struct sanprobe *pr)
+{
+	uint32_t c[2], fsz, csz, n, rate;
+	struct sanprb pb;
+	int f;
+
+	if (!io || !io->ioread || !pr)
+		return 1;
+	memset(pr, 0, sizeof(struct sanprobe));
+	pb.io = io;
+	pb.pos = 0;
+
+	if (prb_read(&pb, c, 8) || c[0] != ANIM)
+		return 80;
+	if (prb_read(&pb, c, 8) || c[0] != AHDR)
+		return 81;
+	csz = be32_to_cpu(c[1]);
+	if (csz < 6 + 768 || prb_read(&pb, pb.t, 6))
+		return 82;
+	pr->version = le16_to_cpu(ua16(pb.t + 0));
+	pr->frames = le16_to_cpu(ua16(pb.t + 2));
+	n = 6;
+	if (pr->version > 1 && csz >= 6 + 768 + 12) {
+		if (prb_skip(&pb, 768) || prb_read(&pb, pb.t, 12))
+			return 82;
+		n += 768 + 12;
+		rate = le32_to_cpu(ua32(pb.t + 0));
+		pr->frame_duration_us = rate ? 1000000 / rate : 0;
+		pr->maxframe = le32_to_cpu(ua32(pb.t + 4));
+		pr->samplerate = le32_to_cpu(ua32(pb.t + 8));
+	} else {
+		pr->frame_duration_us = 1000000 / 10;	/* ANIMv1 default */
+		pr->samplerate = 11025;
+	}
+	if (prb_skip(&pb, csz - n))
+		return 82;
+
+	/* the chunk headers of the FRMEs up to the first one with images */
+	for (f = 0; f < 4 && f < pr->frames && !pr->ncodec; f++) {
+		if (prb_read(&pb, c, 8) || c[0] != FRME)
+			return 83;
+		fsz = be32_to_cpu(c[1]);
+		while (fsz > 7) {
+			if (prb_read(&pb, c, 8))
+				return 83;
+			fsz -= 8;
+			csz = be32_to_cpu(c[1]);
+			if (csz > fsz)
+				return 83;
+			n = 0;
+			if (c[0] == FOBJ && csz >= 14) {
+				n = 14;
+				if (prb_read(&pb, pb.t, n))
+					return 83;
+				prb_fobj(pr, pb.t);
+			} else if ((c[0] == IACT || c[0] == PSAD) && !pr->audio) {
+				n = _min(csz, sizeof(pb.t));
+				if (prb_read(&pb, pb.t, n))
+					return 83;
+				prb_audio(pr, c[0], pb.t, n);
+			}
+			/* chunks are padded to even size */
+			csz = _min(csz + (csz & 1), fsz);
+			if (prb_skip(&pb, csz - n))
+				return 83;
+			fsz -= csz;
+		}
+		if (prb_skip(&pb, fsz))
+			return 83;
+	}
+	return SANDEC_OK;
+}
+
+int sandec_open(void *sanctx, struct sanio *io)
+{
+	return open_source((struct sanctx *)sanctx, io, NULL, 0);
+}
+
+int sandec_open_memory(void *sanctx, struct sanio *io, const void *data,
+		       uint32_t size)
+{
+	if (!data)
+		return 1;
+	return open_source((struct sanctx *)sanctx, io, (const uint8_t *)data, size);
+}
+
 void sandec_exit(void **sanctx)
 {
 	struct sanctx *ctx;
+	int i;
 
 	if (!sanctx)
 		return;
@@ -1734,6 +5696,12 @@ void sandec_exit(void **sanctx)
 		return;
 
 	sandec_free_memories(ctx);
+	pool_free(ctx);
+	/* frames still held are gone now, too */
+	for (i = 0; i < SANDEC_MAXFRAMES; i++) {
+		if (ctx->fold[i])
+			free(ctx->fold[i]);
+	}
 	free(ctx);
 	*sanctx = NULL;
 }
@@ -1747,5 +5715,7 @@ int sandec_get_framecount(void *sanctx)
 int sandec_get_currframe(void *sanctx)
 {
 	struct sanctx *ctx = (struct sanctx *)sanctx;
-	return ctx ? ctx->rt.currframe : 0;
+	if (!ctx)
+		return 0;
+	return ctx->fc.serve ? ctx->fc.pos : ctx->rt.currframe;
 }
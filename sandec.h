@@ -8,7 +8,9 @@
  * Queue new audio data:  Audio is 22.05kHz 16bit Stereo LSB. This callback
  *  can be called multiple times during sandec_decode_next_frame(), always
  *  with new data, so the callback needs to either queue the data immediately,
- *  or append it to a buffer for later consumption.
+ *  or append it to a buffer for later consumption.  PSAD/SAUD and iMUSE
+ *  IACT tracks (Full Throttle, The Dig) are mixed in software and passed
+ *  on in blocks of 4096 bytes, up to the end time of each decoded frame.
  *
  * void my_queue_audio(void *userctx, char *abuf, uint32_t bufsize)
  * {
@@ -36,6 +38,19 @@
  *   duration _may_ vary during playback!
  * }
  *
+ * Alternatively, queue_video_rects() can be set instead, which is called
+ *  with the same parameters, plus the list of areas of the image which
+ *  changed since the previous call.  Everything outside of these is
+ *  identical to the previous image.  If the changes are not known, or the
+ *  palette changed, a single rectangle covering the whole image is passed.
+ *  nrects can be zero if nothing changed.  The list is valid until the next
+ *  invocation of sandec_decode_next_frame().
+ *
+ * void my_queue_video_rects(void *userctx, char *vbuf, uint32_t bufsize,
+ *                           uint16_t w, uint16_t h, uint32_t* pal,
+ *                           uint16_t subid, uint32_t frame_duration_us,
+ *                           const struct sanrect *rects, int nrects)
+ *
  *
  * fetch data callback:  destbuf is always valid, amount is always 1 or more.
  * Return 1 if the requested amount of data was put in the buffer,
@@ -47,6 +62,16 @@
  * }
  *
  *
+ * seek callback (optional): position the data source at the given byte
+ *  offset, counted from the first byte read by sandec_open().
+ * Return 1 on success, 0 on error.
+ *
+ * int my_data_seek(void *userctx, uint32_t offset)
+ * {
+ *	return (lseek(userctx->fhandle, offset, SEEK_SET) == offset);
+ * }
+ *
+ *
  * Set up decoder context and handle frames:
  *
  * void *sancontext;
@@ -60,6 +85,7 @@
  * if (fd < 0) { // error file not found };
  * myavctx.fhandle = fd;
  * myio.ioread = my_data_read;
+ * myio.ioseek = my_data_seek;   // optional, for sandec_seek()
  * myio.userctx = my_avctx;
  * myio.queue_audio = my_queue_audio;
  * myio.queue_video = my_queue_video;
@@ -75,11 +101,22 @@
  * sandec_exit(&sancontext);
  * close(fd);
  *
+ * Files which are already in memory (e.g. mmap()ed) can be opened with
+ *  sandec_open_memory() instead, sanio.ioread() and sanio.ioseek() are then
+ *  not used.  The chunks are parsed in place, without copying them around.
+ *  The data must stay valid until sandec_exit() or the next open.
+ *
  * NOTES:
  * - The decoder only does linear forward reads. Once data has been read, it
- *    it will not be requested again.
+ *    it will not be requested again.  The exception is sandec_seek(), which
+ *    requires sanio.ioseek() to be set.
  * - sanio.queue_audio() can be called multiple times per frame decoding call.
- * - sanio.queue_video() is only called ONCE per frame decoding call.
+ * - sanio.queue_video() is only called ONCE per frame decoding call.  The same
+ *    goes for sanio.queue_video_rects(), which replaces it if set.
+ * - To keep a frame around for longer without copying it, reserve a frame
+ *    pool with sandec_frame_pool() and take a reference on the frame with
+ *    sandec_frame_hold() in the video callback.  Give it back with
+ *    sandec_frame_release() when done with it.
  */
 
 #ifndef _SANDEC_H_
@@ -91,20 +128,157 @@
 #define SANDEC_OK	0
 #define SANDEC_DONE	-1
 /* all other positive values indicate where the error occured */
+/* statistics/trace call, but built without SANDEC_STATS */
+#define SANDEC_ERR_NOSTATS	75
 
 
 /* flags */
 /* do frame interpolation if possible */
 #define SANDEC_FLAG_DO_FRAME_INTERPOLATION	(1 << 0)
+/* decode only the audio: video and palette chunks are skipped, nothing
+ * is passed to queue_video.  Set it before sandec_open(); clearing it
+ * later gives broken images until the next seek.
+ */
+#define SANDEC_FLAG_AUDIO_ONLY			(1 << 1)
+/* decode only the video: IACT and PSAD chunks are skipped, nothing is
+ * passed to queue_audio.
+ */
+#define SANDEC_FLAG_VIDEO_ONLY			(1 << 2)
+/* count the codec block opcodes and motion vectors in struct sancounts,
+ * in a second pass over the bitstream after each codec call.  Its time
+ * is not in the codec stages, but in the frame time.  Only with
+ * SANDEC_STATS, ignored otherwise.
+ */
+#define SANDEC_FLAG_COUNT_OPS			(1 << 3)
+
+/* image formats, see sandec_output() */
+#define SANDEC_FMT_INDEX8	0	/* 8 bit palette index (default)	*/
+#define SANDEC_FMT_ARGB8888	1	/* 32 bit 0xffRRGGBB			*/
+#define SANDEC_FMT_XRGB8888	2	/* 32 bit 0x00RRGGBB			*/
+#define SANDEC_FMT_RGB565	3	/* 16 bit RRRRRGGGGGGBBBBB		*/
+#define SANDEC_FMT_I420		4	/* YUV 4:2:0, Y, U and V planes		*/
+#define SANDEC_FMT_NV12		5	/* YUV 4:2:0, Y and interleaved UV planes */
+
+/* an area of the image, in pixels */
+struct sanrect {
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+};
+
+/* decoding stages timed in struct sanstats */
+#define SANDEC_ST_FRAME		0	/* a whole FRME, incl. callbacks	*/
+#define SANDEC_ST_READ		1	/* reading the FRME data		*/
+#define SANDEC_ST_CODEC1	2	/* FOBJ codec 1/3			*/
+#define SANDEC_ST_CODEC37	3	/* FOBJ codec 37			*/
+#define SANDEC_ST_CODEC47	4	/* FOBJ codec 47			*/
+#define SANDEC_ST_CODEC48	5	/* FOBJ codec 48			*/
+#define SANDEC_ST_IACT		6	/* IACT and PSAD audio			*/
+#define SANDEC_ST_NPAL		7	/* NPAL palette				*/
+#define SANDEC_ST_XPAL		8	/* XPAL palette fades			*/
+#define SANDEC_ST_FTCH		9	/* FTCH image restore			*/
+#define SANDEC_ST_IPOL		10	/* frame interpolation			*/
+#define SANDEC_ST_OUTPUT	11	/* conversion to the output format	*/
+#define SANDEC_ST_NUM		12
+
+struct sanstat {
+	uint64_t ns;		/* time spent, in nanoseconds */
+	uint64_t count;		/* number of times */
+};
+
+/* motion vector length histogram bins: the longer of the x/y distances,
+ *  the last bin holds all longer ones.
+ */
+#define SANDEC_MVBINS		64
+
+/* block sizes of the opcode and motion vector histograms */
+#define SANDEC_BLK8		0	/* 8x8	*/
+#define SANDEC_BLK4		1	/* 4x4	*/
+#define SANDEC_BLK2		2	/* 2x2	*/
+
+/* decoding counters in struct sanstats */
+struct sancounts {
+	uint64_t bytes;		/* FRME bytes read, incl. headers	*/
+	uint64_t frme;		/* FRMEs read				*/
+	uint64_t npal;		/* chunks by type			*/
+	uint64_t fobj;
+	uint64_t iact;
+	uint64_t tres;
+	uint64_t stor;
+	uint64_t ftch;
+	uint64_t xpal;
+	uint64_t psad;
+	uint64_t other;		/* unknown chunks			*/
+	uint64_t codec[256];	/* FOBJs by codec id			*/
+	uint64_t c47op[3][256];	/* codec47 block opcodes by block size	*/
+	uint64_t c48op[256];	/* codec48 8x8 block opcodes		*/
+	uint64_t c37op[256];	/* codec37 4x4 block opcodes		*/
+	uint64_t c47mv[3][SANDEC_MVBINS];	/* codec47 motion vectors by block size */
+	uint64_t c48mv[3][SANDEC_MVBINS];	/* codec48 motion vectors by block size */
+	uint64_t falloc;	/* frame buffer (re)allocations		*/
+	uint64_t fcgrow;	/* FRME cache growths			*/
+	uint64_t fchit;		/* frames served from the frame cache	*/
+};
+
+/* decoding statistics, see sandec_get_stats() */
+struct sanstats {
+	struct sanstat total[SANDEC_ST_NUM];	/* since sandec_open() */
+	struct sanstat frame[SANDEC_ST_NUM];	/* last decoding call */
+	struct sancounts ctotal;		/* since sandec_open() */
+	struct sancounts cframe;		/* last decoding call */
+};
+
+/* a frame held by the caller, see sandec_frame_hold() */
+struct sanframe {
+	unsigned char *vdata;
+	uint32_t *pal;
+	uint32_t size;
+	uint32_t frame_duration_us;
+	uint16_t w;
+	uint16_t h;
+	uint16_t subid;
+	uint32_t palgen;	/* palette generation, see sandec_get_palette() */
+};
+
+/* audio formats, see sandec_probe() */
+#define SANDEC_AUDIO_NONE	0	/* no audio chunks found		*/
+#define SANDEC_AUDIO_IACT	1	/* subchunk-less IACT, COMI and later	*/
+#define SANDEC_AUDIO_IMUSE	2	/* IACT with iMUSE tracks, The Dig	*/
+#define SANDEC_AUDIO_PSAD	3	/* PSAD/SAUD tracks, Full Throttle	*/
+
+#define SANDEC_PROBE_CODECS	4
+
+/* file information from the headers, see sandec_probe() */
+struct sanprobe {
+	uint16_t version;	/* SMUSH version of the AHDR		*/
+	uint16_t frames;	/* number of FRMEs			*/
+	uint32_t frame_duration_us;
+	uint32_t samplerate;	/* from the AHDR			*/
+	uint32_t maxframe;	/* largest FRME size, from the AHDR	*/
+	uint16_t w;		/* image size				*/
+	uint16_t h;
+	uint8_t  codec[SANDEC_PROBE_CODECS];	/* FOBJ codec ids, in order found */
+	uint8_t  ncodec;	/* valid entries in codec[]		*/
+	uint8_t  audio;		/* SANDEC_AUDIO_*			*/
+	uint8_t  abits;		/* audio source format, 0 if unknown	*/
+	uint8_t  achans;
+	uint32_t arate;
+};
 
 struct sanio {
 	int(*ioread)(void *userctx, void *dst, uint32_t size);
+	int(*ioseek)(void *userctx, uint32_t offset);
 	void(*queue_video)(void *userctx, unsigned char *vdata, uint32_t size,
 			  uint16_t w, uint16_t h, uint32_t *pal, uint16_t subid,
 			  uint32_t frame_duration_us);
 	void(*queue_audio)(void *userctx, unsigned char *adata, uint32_t size);
 	void *userctx;
 	uint32_t flags;
+	void(*queue_video_rects)(void *userctx, unsigned char *vdata, uint32_t size,
+				 uint16_t w, uint16_t h, uint32_t *pal, uint16_t subid,
+				 uint32_t frame_duration_us,
+				 const struct sanrect *rects, int nrects);
 };
 
 /* init SAN context. Call this as step 1. */
@@ -113,6 +287,19 @@ int sandec_init(void **sanctx);
 /* open/analyze a SAN file, supply with IO structure with at least "read" set. */
 int sandec_open(void *sanctx, struct sanio *io);
 
+/* open/analyze a SAN file of size bytes in memory at data. */
+int sandec_open_memory(void *sanctx, struct sanio *io, const void *data,
+		       uint32_t size);
+
+/* read just the headers of a SAN file to learn about it, without a
+ *  decoder context and without allocating memory.  Uses sanio.ioread(),
+ *  and sanio.ioseek() if set to skip data; the file must be at its start.
+ *  The image size and codecs come from the first FRME with images (within
+ *  the first 4), the audio format from the first audio chunk up to there.
+ *  Returns SANDEC_OK or an error.
+ */
+int sandec_probe(struct sanio *io, struct sanprobe *pr);
+
 /* Process one full frame (audio+video).
  * will call the queue_audio() callback multiple times, and queue_video()
  * callback once.
@@ -128,4 +315,150 @@ int sandec_get_framecount(void *sanctx);
 /* get the current rendered frame number */
 int sandec_get_currframe(void *sanctx);
 
+/* position the decoder so that the next sandec_decode_next_frame() call
+ * decodes the given frame.  Decoding restarts from the nearest keyframe
+ * before it, frames in between are decoded without any output.
+ * Requires sanio.ioseek().  Returns SANDEC_OK or an error.
+ */
+int sandec_seek(void *sanctx, int frame);
+
+/* read up to depth FRMEs ahead of the decoder in a separate thread, so that
+ *  decoding does not have to wait for I/O while they last.  sanio.ioread()
+ *  is then called from that thread.  depth 0 (default) disables read-ahead.
+ *  Call after sandec_open(); not available for sandec_open_memory() and
+ *  when built with SANDEC_NO_THREADS.
+ */
+int sandec_readahead(void *sanctx, int depth);
+
+/* use nthreads (up to 16) worker threads for decoding, 0 (default) disables
+ *  them.  Audio is then decoded in parallel to the video, and frame
+ *  interpolation and codec47/48 reconstruction are split among the
+ *  workers.  The output and the order of the callbacks does not change,
+ *  they are all called from the thread calling sandec_decode_next_frame().
+ *  Not available when built with SANDEC_NO_THREADS.
+ */
+int sandec_threads(void *sanctx, int nthreads);
+
+/* pass only every nth frame (1 to 65535) to the video callback, with the
+ *  usual frame duration, e.g. for thumbnails or a fast-forward preview.
+ *  The frames in between are still decoded, since the following ones
+ *  build on them, but neither interpolated nor converted to the output
+ *  format.  The first frame after sandec_open() and sandec_seek() is
+ *  always passed out.  n 1 (default) passes all frames; for n > 1 frame
+ *  interpolation is off.
+ */
+int sandec_decimate(void *sanctx, int n);
+
+/* pass images in the given SANDEC_FMT_* format to the video callback,
+ *  instead of palette indices.  The image is converted with the palette
+ *  of the frame, which is still passed along.  YUV images are BT.601
+ *  limited range, with (width+1)/2 * (height+1)/2 chroma samples
+ *  following the luma plane.  The image is written to buf if given, which
+ *  needs to be aligned to the pixel size and big enough for the image
+ *  (the size passed to the video callback); the parts of it not changed according to
+ *  sanio.queue_video_rects() are not written again, so don't modify it.
+ *  Without buf, a buffer of the decoder is used.  Call it before the
+ *  first frame is decoded; later only the buffer and formats of the same
+ *  pixel size can be changed.
+ */
+int sandec_output(void *sanctx, int format, void *buf, uint32_t size);
+
+/* get the current palette, i.e. the one of the frame last passed to the
+ *  video callback, in the given SANDEC_FMT_* format: 32 bit RGB, RGB565 in
+ *  the low 16 bits, or Y | U << 8 | V << 24 for the YUV formats.  The
+ *  alpha is always 0xff, so ARGB8888 is premultiplied, too.  INDEX8 gives
+ *  the palette passed to the video callback.
+ *  generation, if given, is set to a counter which changes whenever the
+ *  palette does, e.g. to upload a palette texture only on actual changes.
+ *  Converted palettes are cached until that happens.  The returned palette
+ *  stays valid until the next decoding call.
+ */
+const uint32_t *sandec_get_palette(void *sanctx, int format, uint32_t *generation);
+
+/* reserve memory for count (up to 8) frames held with sandec_frame_hold(),
+ *  0 (default) disables holding frames.  The pool is part of the frame
+ *  buffers, call it before the first frame is decoded.
+ */
+int sandec_frame_pool(void *sanctx, int count);
+
+/* keep the decoded frames, RLE-packed with their palette, in up to budget
+ *  bytes of memory, dropping the least recently used ones; 0 (default)
+ *  disables it.  sandec_seek() to a frame in there then costs no decoding,
+ *  and neither do the frames following it while they are in there, too.
+ *  These come without interpolation and without audio.  Then decoding
+ *  continues where it left off, if that's the next frame, or after a seek.
+ */
+int sandec_frame_cache(void *sanctx, uint32_t budget);
+
+/* take a reference on the frame last passed to the video callback, from
+ *  within the callback or before the next sandec_decode_next_frame() call.
+ *  The frame data then stays valid until the reference is dropped with
+ *  sandec_frame_release(), the frame is not copied unless the decoder needs
+ *  its buffer back in the meantime.  Holding the same frame again returns
+ *  the same handle with another reference.  Returns NULL if all frames of
+ *  the pool are held already.
+ *  Frames still held at sandec_exit() are freed along with the decoder.
+ */
+struct sanframe *sandec_frame_hold(void *sanctx);
+
+/* drop a reference taken with sandec_frame_hold() */
+void sandec_frame_release(void *sanctx, struct sanframe *frame);
+
+/* get the time spent in each decoding stage and the counters, in total
+ *  and during the last sandec_decode_next_frame() call.  Audio decoded on
+ *  a worker thread is counted, too.  The codec opcodes and motion vectors
+ *  are only counted with SANDEC_FLAG_COUNT_OPS.
+ *  Only available when sandec.c is built with SANDEC_STATS defined, all
+ *  of it is left out otherwise and SANDEC_ERR_NOSTATS is returned.
+ */
+int sandec_get_stats(void *sanctx, struct sanstats *st);
+
+/* call fn after each timed decoding stage (SANDEC_ST_*), with the
+ *  CLOCK_MONOTONIC time it began at and its duration, both in ns; e.g. to
+ *  write Chrome trace events.  Stages done on worker threads are reported
+ *  from there.  NULL turns it off.  Needs SANDEC_STATS, like above.
+ */
+int sandec_trace(void *sanctx, void (*fn)(void *userctx, int stage,
+					   uint64_t start, uint64_t ns));
+
+/* FRME index sidecar: serialize the FRME index of the opened file into buf,
+ *  for storing it alongside the movie.  Completes the index first if
+ *  sanio.ioseek() is available.  *size is the size of buf on input, and
+ *  the number of bytes written on output; with buf NULL, only the required
+ *  size is returned.
+ */
+int sandec_index_export(void *sanctx, void *buf, uint32_t *size);
+
+/* load an exported FRME index after sandec_open().  The index data is
+ *  rejected if it doesn't match the opened file.  Returns SANDEC_OK or
+ *  an error.
+ */
+int sandec_index_import(void *sanctx, const void *buf, uint32_t size);
+
+/* snapshot flags */
+#define SANDEC_SNAP_RLE		(1 << 0)	/* run-length compress it */
+
+/* decoder state snapshot: serialize everything the following frames
+ *  depend on (images, palettes, interpolation table, IACT reassembly and
+ *  the file position) into buf, e.g. as periodic checkpoints for quick
+ *  seeking and reverse playback.  Works like sandec_index_export(): *size
+ *  is the size of buf on input and the bytes written on output, with buf
+ *  NULL only the required size is returned.  The snapshot is for the same
+ *  decoder build on the same machine, it's not portable.  While frames
+ *  come from the frame cache (see sandec_frame_cache()), the decoder
+ *  first seeks to the next one, like a sandec_seek() outside of the cache,
+ *  so that the snapshot is of that frame.
+ */
+int sandec_snapshot(void *sanctx, void *buf, uint32_t *size, int flags);
+
+/* restore a snapshot of the opened file: the next frame decoded is the one
+ *  sandec_get_currframe() returned when it was taken.  Audio tracks of
+ *  PSAD/iMUSE files playing at that point are lost, as with a seek.
+ *  Requires sanio.ioseek().  Damaged snapshots are found by a checksum
+ *  and leave the decoder as it was.  If restoring fails halfway, decoding
+ *  continues after a successful sandec_seek() or sandec_restore() only.
+ *  Returns SANDEC_OK or an error.
+ */
+int sandec_restore(void *sanctx, const void *buf, uint32_t size);
+
 #endif
@@ -14,12 +14,15 @@ struct playpriv {
 	FILE *fhdl;
 	SDL_Renderer *ren;
 	SDL_Window *win;
+	SDL_Texture *tex;
 	SDL_AudioDeviceID aud;
 
 	uint16_t pxw;
 	uint16_t pxh;
 	uint16_t winw;
 	uint16_t winh;
+	uint16_t texw;
+	uint16_t texh;
 
 	uint32_t vbufsize;
 	uint32_t frame_duration;
@@ -48,9 +51,6 @@ static void queue_video(void *ctx, unsigned char *vdata, uint32_t size,
 			uint32_t frame_duration_us)
 {
 	struct playpriv *p = (struct playpriv *)ctx;
-	SDL_Palette *pal;
-	SDL_Surface *sur;
-	SDL_Texture *tex;
 	int ret, nw, nh;
 
 	if (p->err || p->sm == 2)
@@ -86,38 +86,32 @@ static void queue_video(void *ctx, unsigned char *vdata, uint32_t size,
 		}
 	}
 
-	sur = SDL_CreateRGBSurfaceWithFormatFrom(vdata, w, h, 8, w, SDL_PIXELFORMAT_INDEX8);
-	if (!sur) {
-		p->err = 1101;
-		return;
+	/* the decoder hands out ARGB8888 images, which go straight into
+	 * a texture.
+	 */
+	if (!p->tex || p->texw != w || p->texh != h) {
+		if (p->tex)
+			SDL_DestroyTexture(p->tex);
+		p->tex = SDL_CreateTexture(p->ren, SDL_PIXELFORMAT_ARGB8888,
+					   SDL_TEXTUREACCESS_STREAMING, w, h);
+		if (!p->tex) {
+			p->err = 1104;
+			return;
+		}
+		p->texw = w;
+		p->texh = h;
 	}
 
-	pal = SDL_AllocPalette(256);
-	if (!pal) {
-		SDL_FreeSurface(sur);
-		p->err = 1102;
-		return;
-	}
-	memcpy(pal->colors, imgpal, 256 * sizeof(uint32_t));
-	ret = SDL_SetSurfacePalette(sur, pal);
+	ret = SDL_UpdateTexture(p->tex, NULL, vdata, w * 4);
 	if (ret) {
-		SDL_FreeSurface(sur);
-		p->err = 1103;
-		return;
-	}
-
-	tex = SDL_CreateTextureFromSurface(p->ren, sur);
-	if (!tex) {
-		p->err = 1104;
+		p->err = 1101;
 		return;
 	}
-	ret = SDL_RenderCopy(p->ren, tex, NULL, NULL);
+	ret = SDL_RenderCopy(p->ren, p->tex, NULL, NULL);
 	if (ret) {
 		p->err = 1003;
 		return;
 	}
-	SDL_DestroyTexture(tex);
-	SDL_FreeSurface(sur);
 	p->vbufsize = size;
 	p->pxw = w;
 	p->pxh = h;
@@ -140,6 +134,8 @@ static void exit_sdl(struct playpriv *p)
 {
 	if (p->aud)
 		SDL_CloseAudioDevice(p->aud);
+	if (p->tex)
+		SDL_DestroyTexture(p->tex);
 	if (p->ren)
 		SDL_DestroyRenderer(p->ren);
 	if (p->win)
@@ -187,6 +183,12 @@ static int sio_read(void *ctx, void *dst, uint32_t size)
 	return fread(dst, 1, size, p->fhdl) == size;
 }
 
+static int sio_seek(void *ctx, uint32_t offset)
+{
+	struct playpriv *p = (struct playpriv *)ctx;
+	return fseek(p->fhdl, offset, SEEK_SET) == 0;
+}
+
 int main(int a, char **argv)
 {
 	int ret, speedmode, dtick, fc, running, paused, parserdone;
@@ -226,10 +228,13 @@ int main(int a, char **argv)
 	}
 	pp.sm = speedmode;
 	sio.ioread = sio_read;
+	sio.ioseek = sio_seek;
 	sio.userctx = &pp;
 	sio.queue_audio = queue_audio;
 	sio.queue_video = queue_video;
 	sio.flags = speedmode ? 0 : SANDEC_FLAG_DO_FRAME_INTERPOLATION;
+	/* get images in the texture format */
+	sandec_output(sanctx, SANDEC_FMT_ARGB8888, NULL, 0);
 
 	ret = sandec_open(sanctx, &sio);
 	if (ret) {
@@ -237,6 +242,11 @@ int main(int a, char **argv)
 		goto out;
 	}
 
+	/* keep a few frames ahead in case the file is on slow storage */
+	sandec_readahead(sanctx, 4);
+	/* decode audio and interpolate frames on other cores */
+	sandec_threads(sanctx, 2);
+
 	fc = sandec_get_framecount(sanctx);
 	running = 1;
 	paused = 0;
@@ -270,6 +280,15 @@ int main(int a, char **argv)
 						pp.nextmult = ke->keysym.scancode - SDL_SCANCODE_1 + 1;
 					} else if (ke->keysym.scancode == SDL_SCANCODE_I) {
 						sio.flags ^= SANDEC_FLAG_DO_FRAME_INTERPOLATION;
+					} else if ((ke->keysym.scancode == SDL_SCANCODE_LEFT) ||
+						   (ke->keysym.scancode == SDL_SCANCODE_RIGHT)) {
+						/* seek 5 seconds back/forth */
+						int nf, step = 5000000 / (pp.frame_duration ? pp.frame_duration : 100000);
+						nf = sandec_get_currframe(sanctx);
+						nf += (ke->keysym.scancode == SDL_SCANCODE_LEFT) ? -step : step;
+						nf = nf < 0 ? 0 : (nf >= fc ? fc - 1 : nf);
+						if (!parserdone && 0 == sandec_seek(sanctx, nf))
+							SDL_ClearQueuedAudio(pp.aud);
 					}
 			}
 		}
@@ -0,0 +1,224 @@
+/*
+ * SAN library cataloguer.
+ *
+ * Walks the given files and directories for .san/.nut/.anm files, reads
+ * just their headers with sandec_probe() on a few threads and prints one
+ * tab-separated line per file, in the order found.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "sandec.h"
+
+#define MAXTHREADS	64
+
+struct scanfile {
+	char *path;
+	struct sanprobe pr;
+	int ret;
+};
+
+struct scan {
+	struct scanfile *f;
+	int n;
+	int max;
+	int next;		/* next file to probe */
+	pthread_mutex_t mtx;
+};
+
+static const char * const audioname[] = {
+	"none", "iact", "imuse", "psad",
+};
+
+static int sio_read(void *ctx, void *dst, uint32_t size)
+{
+	return fread(dst, 1, size, (FILE *)ctx) == size;
+}
+
+static int sio_seek(void *ctx, uint32_t offset)
+{
+	return fseek((FILE *)ctx, offset, SEEK_SET) == 0;
+}
+
+static int is_san(const char *name)
+{
+	const char *e = strrchr(name, '.');
+
+	return e && (!strcasecmp(e, ".san") || !strcasecmp(e, ".nut")
+		     || !strcasecmp(e, ".anm"));
+}
+
+static int add_file(struct scan *s, const char *path)
+{
+	struct scanfile *f;
+
+	if (s->n >= s->max) {
+		f = realloc(s->f, (s->max + 256) * sizeof(struct scanfile));
+		if (!f)
+			return 1;
+		s->f = f;
+		s->max += 256;
+	}
+	f = &s->f[s->n];
+	memset(f, 0, sizeof(struct scanfile));
+	f->path = strdup(path);
+	if (!f->path)
+		return 1;
+	s->n++;
+	return 0;
+}
+
+/* collect the SAN files below path; files given directly are always taken */
+static int walk(struct scan *s, const char *path, int top)
+{
+	struct dirent *de;
+	struct stat st;
+	char *sub;
+	DIR *d;
+	int ret = 0;
+
+	if (stat(path, &st))
+		return top ? 1 : 0;
+	if (!S_ISDIR(st.st_mode))
+		return (top || is_san(path)) ? add_file(s, path) : 0;
+
+	d = opendir(path);
+	if (!d)
+		return top ? 1 : 0;
+	while (ret == 0 && (de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		sub = malloc(strlen(path) + strlen(de->d_name) + 2);
+		if (!sub) {
+			ret = 1;
+			break;
+		}
+		sprintf(sub, "%s/%s", path, de->d_name);
+		ret = walk(s, sub, 0);
+		free(sub);
+	}
+	closedir(d);
+	return ret;
+}
+
+static void *worker(void *arg)
+{
+	struct scan *s = (struct scan *)arg;
+	struct scanfile *f;
+	struct sanio sio;
+	FILE *fh;
+	int i;
+
+	memset(&sio, 0, sizeof(struct sanio));
+	sio.ioread = sio_read;
+	sio.ioseek = sio_seek;
+	while (1) {
+		pthread_mutex_lock(&s->mtx);
+		i = s->next++;
+		pthread_mutex_unlock(&s->mtx);
+		if (i >= s->n)
+			break;
+		f = &s->f[i];
+		fh = fopen(f->path, "rb");
+		if (!fh) {
+			f->ret = -1;
+			continue;
+		}
+		sio.userctx = fh;
+		f->ret = sandec_probe(&sio, &f->pr);
+		fclose(fh);
+	}
+	return NULL;
+}
+
+static void print_file(struct scanfile *f)
+{
+	struct sanprobe *pr = &f->pr;
+	double fps;
+	int i;
+
+	if (f->ret) {
+		printf("%s\terror %d\n", f->path, f->ret);
+		return;
+	}
+	fps = pr->frame_duration_us ? 1e6 / pr->frame_duration_us : 0.0;
+	printf("%s\t%u\t%u\t%.2f\t%.1f\t%ux%u\t", f->path, pr->version,
+	       pr->frames, fps, pr->frames * (pr->frame_duration_us / 1e6),
+	       pr->w, pr->h);
+	for (i = 0; i < pr->ncodec; i++)
+		printf("%s%u", i ? "," : "", pr->codec[i]);
+	printf("%s\t%s", pr->ncodec ? "" : "-", audioname[pr->audio]);
+	if (pr->abits)
+		printf(" %ubit %uch %uHz", pr->abits, pr->achans, pr->arate);
+	printf("\n");
+}
+
+int main(int a, char **argv)
+{
+	pthread_t th[MAXTHREADS];
+	int i, opt, nt, err;
+	struct timespec t0, t1;
+	struct scan s;
+	double ms;
+
+	nt = 4;
+	while ((opt = getopt(a, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j': nt = strtol(optarg, NULL, 10); break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= a || nt < 1 || nt > MAXTHREADS)
+		goto usage;
+
+	memset(&s, 0, sizeof(struct scan));
+	pthread_mutex_init(&s.mtx, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	err = 0;
+	for (i = optind; i < a; i++) {
+		if (walk(&s, argv[i], 1)) {
+			fprintf(stderr, "%s: cannot read\n", argv[i]);
+			err = 2;
+		}
+	}
+
+	nt = nt < s.n ? nt : (s.n ? s.n : 1);
+	for (i = 0; i < nt; i++) {
+		if (pthread_create(&th[i], NULL, worker, &s)) {
+			nt = i;
+			break;
+		}
+	}
+	if (nt == 0)
+		worker(&s);
+	for (i = 0; i < nt; i++)
+		pthread_join(th[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	printf("# file\tversion\tframes\tfps\tseconds\tsize\tcodecs\taudio\n");
+	for (i = 0; i < s.n; i++) {
+		print_file(&s.f[i]);
+		if (s.f[i].ret)
+			err = 3;
+		free(s.f[i].path);
+	}
+	ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+	fprintf(stderr, "%d files, %.1f ms, %.3f ms/file\n", s.n, ms,
+		s.n ? ms / s.n : 0.0);
+	free(s.f);
+	pthread_mutex_destroy(&s.mtx);
+	return err;
+
+usage:
+	printf("usage: %s [-j threads] <file or directory>...\n", argv[0]);
+	printf(" -j: probe files on that many threads (default 4)\n");
+	return 1;
+}